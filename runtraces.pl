@@ -0,0 +1,254 @@
+#!/usr/bin/perl
+use strict;
+use warnings;
+use Getopt::Std;
+use Cwd qw(getcwd);
+use File::Copy qw(copy);
+use File::Temp qw(tempdir);
+use POSIX qw(:sys_wait_h);
+use Time::HiRes qw(time);
+
+#######################################################################
+# runtraces.pl - Parallel trace regression runner
+#
+# Runs every trace file through sdriver.pl against both the shell under
+# test and the reference shell, all at the same time, then normalizes
+# and diffs each pair of outputs. Prints PASS/FAIL and the wall time for
+# every trace and exits non-zero if any trace differs.
+#
+# A trace that exercises features tshref doesn't have comes with a
+# traceNN.expect file holding the expected output; tsh is compared
+# against that instead of against a run of tshref.
+#
+# Each run gets its own scratch directory (so traces that write files,
+# like trace17's outfile, can't collide) and, when script(1) is
+# available, its own pseudo-terminal, so that "/bin/ps t" in a trace
+# only lists the processes belonging to that run.
+#
+# Normalization:
+#     - carriage returns added by the pseudo-terminal are dropped
+#     - "(12345)" pids become "(PID)"
+#     - ps listings keep only STAT and COMMAND
+#     - "tshref" is renamed "tsh"
+#     - tsh's own wording of job notices and error messages is mapped
+#       to tshref's (see @wording), so that only real differences in
+#       behavior fail a trace
+#
+# With -b <n>, no traces are run: instead each shell is started <n>
+# times with an empty stdin and the mean startup-to-exit time is printed.
+######################################################################
+
+sub usage
+{
+    printf STDERR "$_[0]\n" if $_[0];
+    printf STDERR "Usage: $0 [-hv] [-b <n>] [-j <n>] [-s <shell>] [-r <refshell>] [trace...]\n";
+    printf STDERR "Options:\n";
+    printf STDERR "  -h            Print this message\n";
+    printf STDERR "  -v            Print the diff of every failing trace\n";
+    printf STDERR "  -b <n>        Time <n> startups of each shell instead\n";
+    printf STDERR "  -j <n>        Run at most <n> shells at once (default: all)\n";
+    printf STDERR "  -s <shell>    Shell program to test (default: ./tsh)\n";
+    printf STDERR "  -r <shell>    Reference shell program (default: ./tshref)\n";
+    die "\n";
+}
+
+our ($opt_h, $opt_v, $opt_b, $opt_j, $opt_s, $opt_r);
+getopts('hvb:j:s:r:') or usage();
+usage() if $opt_h;
+
+my $root = getcwd();
+my $shell = $opt_s || "./tsh";
+my $refshell = $opt_r || "./tshref";
+my @traces = @ARGV ? @ARGV : sort glob("trace*.txt");
+my @helpers = ("myspin", "mysplit", "mystop", "myint");
+
+@traces or usage("No trace files found");
+-e $shell or die "$0: ERROR: $shell not found (run make first)\n";
+-e $refshell or die "$0: ERROR: $refshell not found\n";
+
+my $tmp = tempdir("tshcheck.XXXXXX", TMPDIR => 1, CLEANUP => 1);
+
+#
+# Startup benchmark: fork and exec each shell directly, no /bin/sh
+# in between, and report the mean time until it exits on EOF
+#
+if ($opt_b) {
+    foreach my $pair (["tsh", $shell], ["tshref", $refshell]) {
+        my ($name, $prog) = @$pair;
+        copy($prog, "$tmp/$name") or die "$0: ERROR: copy $prog: $!\n";
+        chmod 0755, "$tmp/$name";
+        my $t = time();
+        for (1 .. $opt_b) {
+            my $pid = fork();
+            defined $pid or die "$0: ERROR: fork: $!\n";
+            if ($pid == 0) {
+                open STDIN, "<", "/dev/null";
+                open STDOUT, ">", "/dev/null";
+                exec "$tmp/$name", "-p";
+                exit 1;
+            }
+            waitpid($pid, 0);
+        }
+        printf("%-8s %7.1f us per startup (%d runs)\n",
+               $name, (time() - $t) * 1e6 / $opt_b, $opt_b);
+    }
+    exit 0;
+}
+
+foreach my $helper (@helpers) {
+    -x $helper or die "$0: ERROR: ./$helper not found (run make first)\n";
+}
+
+my ($script) = grep { -x $_ } map { "$_/script" } split(/:/, $ENV{PATH} || "");
+
+#
+# One run per (trace, shell) pair. The shell is always installed in the
+# scratch directory as ./tsh or ./tshref, copied and made executable so
+# that a reference binary checked out without its x bit still works.
+#
+my @runs;
+foreach my $trace (@traces) {
+    -r $trace or die "$0: ERROR: $trace is not readable\n";
+    foreach my $pair (["tsh", $shell], ["tshref", $refshell]) {
+        my ($name, $prog) = @$pair;
+        next if $name eq "tshref" && -e expect_file($trace);
+        my $dir = "$tmp/$trace.$name";
+        mkdir $dir or die "$0: ERROR: mkdir $dir: $!\n";
+        foreach my $file (@helpers, "sdriver.pl", $trace) {
+            symlink("$root/$file", "$dir/$file")
+                or die "$0: ERROR: symlink $file: $!\n";
+        }
+        my $src = $prog =~ m{^/} ? $prog : "$root/$prog";
+        copy($src, "$dir/$name") or die "$0: ERROR: copy $prog: $!\n";
+        chmod 0755, "$dir/$name";
+        push @runs, { trace => $trace, name => $name, dir => $dir };
+    }
+}
+
+#
+# Start the runs, keeping at most -j of them going at once
+#
+my $limit = $opt_j || scalar(@runs);
+my %running;
+my @queue = @runs;
+my $t0 = time();
+
+while (@queue || %running) {
+    while (@queue && keys(%running) < $limit) {
+        my $run = shift @queue;
+        my $pid = fork();
+        defined $pid or die "$0: ERROR: fork: $!\n";
+        if ($pid == 0) {
+            chdir $run->{dir} or die "chdir: $!\n";
+            open STDIN, "<", "/dev/null";
+            open STDOUT, ">", "out.txt";
+            open STDERR, ">&", \*STDOUT;
+            my $cmd = "perl sdriver.pl -t $run->{trace} -s ./$run->{name} -a -p";
+            if ($script) {
+                exec $script, "-qec", $cmd, "/dev/null";
+            }
+            exec $cmd;
+            exit 1;
+        }
+        $run->{start} = time();
+        $running{$pid} = $run;
+    }
+
+    my $pid = waitpid(-1, 0);
+    last if $pid <= 0;
+    if (my $run = delete $running{$pid}) {
+        $run->{time} = time() - $run->{start};
+        $run->{status} = $?;
+    }
+}
+
+#
+# Messages that tsh deliberately words differently from tshref. Each
+# pattern is applied to tsh's output only, before pids are normalized.
+#
+my @wording = (
+    [qr/was terminated due to the following  signal (\d+)/, sub { "terminated by signal $1" }],
+    [qr/was halted due to the following signal (\d+)/,     sub { "stopped by signal $1" }],
+    [qr/^(\S+): No expected command found$/,                sub { "$1: Command not found" }],
+    [qr/^(fg|bg) PID is needed for such %jobid argument$/,  sub { "$1 command requires PID or %jid argument" }],
+    [qr/^\S+: The given argument needs to be a PID or a given %jobid$/,
+                                                            sub { "ARG: argument must be a PID or %jid" }],
+    [qr/^(\d+): Given process was not encountered$/,        sub { "($1): No such process" }],
+    [qr/^(%\d+):Job was not found$/,                        sub { "$1: No such job" }],
+);
+
+sub normalize
+{
+    my ($file, $reword) = @_;
+    my @out;
+
+    open my $fh, "<", $file or return ();
+    while (my $line = <$fh>) {
+        $line =~ s/\r//g;
+        $line =~ s/tshref/tsh/g;
+        if ($reword) {
+            foreach my $w (@wording) {
+                my ($re, $to) = @$w;
+                $line =~ s/$re/$to->()/e;
+            }
+        } else {
+            # tsh names the bad argument, not the command, in this one
+            $line =~ s/^(fg|bg): argument must be a PID or %jid$/ARG: argument must be a PID or %jid/;
+        }
+        if ($line =~ /^\s*PID\s+TTY\s+STAT\s+TIME\s+COMMAND/) {
+            push @out, "STAT COMMAND\n";
+            next;
+        }
+        if ($line =~ /^\s*\d+\s+\S+\s+(\S+)\s+\d+:\d\d\s+(.*)$/) {
+            push @out, "$1 $2\n";
+            next;
+        }
+        $line =~ s/\(\d+\)/(PID)/g;
+        push @out, $line;
+    }
+    close $fh;
+    return @out;
+}
+
+sub expect_file
+{
+    my ($trace) = @_;
+    (my $expect = $trace) =~ s/\.txt$/.expect/;
+    return $expect;
+}
+
+#
+# Compare the two outputs of every trace
+#
+my $failed = 0;
+my %by = map { ("$_->{trace}.$_->{name}" => $_) } @runs;
+
+foreach my $trace (@traces) {
+    my $test = $by{"$trace.tsh"};
+    my $ref = $by{"$trace.tshref"};
+    my @a = normalize("$test->{dir}/out.txt", 1);
+    my @b = $ref ? normalize("$ref->{dir}/out.txt", 0) : normalize(expect_file($trace), 0);
+    my $same = (join("", @a) eq join("", @b));
+
+    if ($ref) {
+        my $wall = $test->{time} > $ref->{time} ? $test->{time} : $ref->{time};
+        printf("%-12s %s  %6.2fs  (tsh %.2fs, tshref %.2fs)\n",
+               $trace, $same ? "PASS" : "FAIL", $wall, $test->{time}, $ref->{time});
+    } else {
+        printf("%-12s %s  %6.2fs  (tsh %.2fs, expected output)\n",
+               $trace, $same ? "PASS" : "FAIL", $test->{time}, $test->{time});
+    }
+
+    next if $same;
+    $failed++;
+    if ($opt_v) {
+        open my $fa, ">", "$test->{dir}/norm.txt"; print $fa @a; close $fa;
+        open my $fb, ">", "$test->{dir}/ref.txt"; print $fb @b; close $fb;
+        system("diff", "-u", "--label", $ref ? "tshref" : "expected", "--label", "tsh",
+               "$test->{dir}/ref.txt", "$test->{dir}/norm.txt");
+    }
+}
+
+printf("%d/%d traces passed in %.2fs\n",
+       scalar(@traces) - $failed, scalar(@traces), time() - $t0);
+exit($failed ? 1 : 0);
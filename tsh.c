@@ -2,7 +2,9 @@
  * tsh - A tiny shell program with job control
  *
  */
+#define _GNU_SOURCE         /* accept4, memfd_create */
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -12,11 +14,34 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <sys/uio.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
 
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
 #define MAXARGS     128   /* max args on a command line */
 #define MAXJOBS      16   /* max jobs at any point in time */
+#define MAXCLIENTS   64   /* max control socket connections */
+#define MAXDEFS      64   /* max aliases and functions */
+#define MAXBODY      16   /* max commands in a for loop body */
+#define NBUCKETS     64   /* hash chains for interned command lines */
+#define MAXKEY     4096   /* max length of a command cache key */
+#define OUTBUF     8192   /* shell output held between flushes */
+#define HISTBLOCK    64   /* history entries per search filter */
+#define HISTBLOOM  1024   /* bytes per search filter */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -24,6 +49,11 @@
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
 
+/* Job journal record types */
+#define J_ADD   1 /* job added (carries its command line) */
+#define J_STATE 2 /* job changed state */
+#define J_DEL   3 /* job deleted */
+
 /*
  * Jobs states: FG (foreground), BG (background), ST (stopped)
  * Job state transitions and enabling actions:
@@ -38,18 +68,147 @@
 extern char **environ;      /* defined in libc */
 char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
+int time_startup = 0;       /* -T: report where startup time goes */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
 
-struct job_t {              /* Per-job data */
+struct job_t {              /* Per-job data, kept small for scanning */
     pid_t pid;              /* job PID */
+    pid_t pgid;             /* process group to signal */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, FG, BG, or ST */
-    char cmdline[MAXLINE];  /* command line */
+    int cmd;                /* interned command line, see jobcmd() */
+    int owner;              /* control client that started it, or -1 */
 };
 struct job_t jobs[MAXJOBS]; /* The job list */
 
+struct istr_t {             /* An interned string in strarena */
+    unsigned hash;          /* strhash of the text */
+    int refs;               /* jobs using it; 0 when the slot is free */
+    int off;                /* offset of the text in strarena */
+    int len;                /* length including the '\0' */
+    int next;               /* next in hash chain, or in free list */
+};
+struct istr_t *istrs;       /* interned strings; handle 0 is unused */
+int num_istrs, max_istrs;
+int free_istr = 0;          /* head of the free handle list */
+int buckets[NBUCKETS];      /* hash chains of handles */
+char *strarena;             /* the text of every interned string */
+int arena_used, arena_size;
+int arena_dead = 0;         /* bytes in strarena no longer referenced */
+
 volatile sig_atomic_t ready; /* Is the newest child in its own process group? */
 
+struct cmd_t {              /* A tokenized command line */
+    int argc;               /* number of tokens */
+    int pipes;              /* number of '|' tokens */
+    int plain;              /* no redirections: stages split on '|' alone */
+    int stage[MAXARGS];     /* index of each stage's first token */
+    char *argv[MAXARGS];    /* the tokens, NULL-terminated */
+};
+
+struct def_t {              /* An alias or shell function */
+    char *name;             /* what it is invoked as, NULL if slot free */
+    char *text;             /* the body as it was defined */
+    char *store;            /* backing storage for name and cmd.argv */
+    int is_func;            /* function (positional args) or alias */
+    struct cmd_t cmd;       /* the body, tokenized and scanned once */
+};
+struct def_t defs[MAXDEFS]; /* The alias and function registry */
+
+struct builtin_t {          /* A builtin command */
+    char *name;
+    int (*run)(char **argv);
+};
+
+struct var_t {              /* A shell variable */
+    char *entry;            /* "NAME=value", usable as an envp entry */
+    int name_len;           /* length of NAME */
+    int exported;           /* passed to children? */
+};
+struct var_t *vars;         /* The variable table */
+int num_vars, max_vars;
+int vars_loaded = 0;        /* environ imported into vars yet? */
+char **exec_envp;           /* exported vars, ready for execve */
+int envp_dirty = 1;         /* exec_envp needs rebuilding */
+
+struct hist_rec_t {         /* One history index record */
+    unsigned long long off; /* where the line starts in the log */
+    unsigned len;           /* line length, without its '\n' */
+    char prefix[4];         /* first bytes of the line, for !prefix */
+};
+int hist_enabled = 0;       /* keep history? (interactive or TSH_HISTFILE) */
+int hist_log = -1;          /* the history log, one line per entry */
+int hist_idx = -1;          /* fixed-size hist_rec_t per entry */
+struct hist_rec_t *hist_recs; /* mapped index */
+char *hist_text;            /* mapped log */
+size_t hist_count;          /* records covered by the mappings */
+size_t hist_text_len;
+int hist_tri = -1;          /* entry count, then a trigram filter per block */
+unsigned char *hist_bloom;  /* mapped filters (header slot first) */
+size_t hist_bloom_len;
+size_t hist_indexed;        /* entries the mapped filters cover */
+char **hist_pending;        /* lines waiting for the file lock */
+int num_pending, max_pending;
+
+pid_t exit_pid;             /* last job process reaped, */
+int exit_status;            /* and its wait status */
+
+struct cache_hdr_t {        /* Start of a command cache entry */
+    char magic[4];          /* "tshc" */
+    unsigned keylen;        /* the full key follows, then the output */
+};
+struct cache_ent_t {        /* A cache entry, for LRU eviction */
+    char name[17];          /* 16 hex digits of the key's hash */
+    long long used;         /* mtime in ns, bumped on every hit */
+    long long size;
+};
+
+struct jrec_t {             /* Job journal record header */
+    int op;                 /* J_ADD, J_STATE or J_DEL */
+    pid_t pid;
+    int jid;
+    int state;
+    unsigned long long start; /* /proc start time, to spot pid reuse */
+    int len;                /* command line bytes following (J_ADD) */
+};
+struct adopted_t {          /* A job restored from the journal */
+    pid_t pid;
+    int pidfd;              /* readable once the process exits */
+    unsigned long long start;
+};
+int journal_fd = -1;        /* job journal, if -J was given */
+struct adopted_t adopted[MAXJOBS];
+int num_adopted;
+
+char outbuf[OUTBUF];        /* shell output not yet written */
+int out_len;
+char sigbuf[OUTBUF];        /* output queued by the SIGCHLD handler */
+volatile sig_atomic_t sig_len;
+
+struct linebuf_t {          /* Buffered line reader for one input fd */
+    int fd;                 /* descriptor being read, -1 if closed */
+    int len;                /* bytes currently held in buf */
+    char buf[MAXLINE];      /* unconsumed input */
+};
+struct linebuf_t input = {STDIN_FILENO, 0}; /* The shell's stdin */
+struct linebuf_t *cur_input = &input;       /* source of the line being run */
+
+struct heredoc_t {          /* A here-doc body waiting to be used */
+    char *tok;              /* the << token it belongs to */
+    int fd;                 /* memfd holding the body */
+};
+struct heredoc_t heredocs[MAXARGS];
+int num_heredocs = 0;
+int procsub_fds[MAXARGS];   /* parent ends of <(cmd) and >(cmd) pipes */
+int num_procsubs = 0;
+
+int ctl_fd = -1;                          /* listening control socket */
+int out_owner = -1;                       /* client stdout points at, or -1 */
+int shell_stdout = STDOUT_FILENO;         /* the shell's own stdout */
+char *ctl_path = NULL;                    /* where ctl_fd is bound */
+char *journal_path = NULL;                /* -J job journal */
+struct linebuf_t ctl_clients[MAXCLIENTS]; /* connected control clients */
+
 /* End global variables */
 
 
@@ -66,11 +225,11 @@ void sigtstp_handler(int sig);
 
 /* Here are helper routines that we've provided for you */
 int parseline(const char *cmdline, char **argv);
+int split_line(const char *cmdline, char *buf, char **argv);
 void sigquit_handler(int sig);
 void sigusr1_handler(int sig);
 
 void clearjob(struct job_t *job);
-void initjobs(struct job_t *jobs);
 int freejid(struct job_t *jobs);
 int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
 int deletejob(struct job_t *jobs, pid_t pid);
@@ -80,7 +239,29 @@ struct job_t *getjobjid(struct job_t *jobs, int jid);
 int pid2jid(pid_t pid);
 void listjobs(struct job_t *jobs);
 
+unsigned strhash(const char *s);
+int intern(const char *text);
+void release(int h);
+void compact_arena(void);
+char *jobcmd(struct job_t *job);
+
+void journal_open(char *path);
+void journal(int op, struct job_t *job);
+unsigned long long proc_start(pid_t pid, char *state);
+int find_adopted(pid_t pid);
+int adopted_check(int i);
+void adopted_refresh(void);
+void wait_adopted(pid_t pid);
+
+void oprintf(const char *fmt, ...);
+void sig_printf(const char *fmt, ...);
+void take_sigbuf(void);
+void notify(struct job_t *job, const char *fmt, ...);
+void oflush(void);
+void write_all(struct iovec *iov, int cnt);
+
 void usage(void);
+void startup_report(struct timespec *cpu, struct timespec *phases);
 void unix_error(char *msg);
 void app_error(char *msg);
 typedef void handler_t(int);
@@ -90,6 +271,91 @@ void sectioning_pipe(char **argv, char **argv_sec, int *file_inpt, int *file_opt
 int total_num_pipes(char **argv);
 struct job_t* checkingType(char *arg, struct job_t *total_job);
 void getting_redirect(int fl_input, int fl_output, int i2, int pipe_counter, int *pipefds);
+void do_kill(char **argv);
+pid_t launch_cmd(struct cmd_t *cmd, int command_bg, char *cmdline);
+void cmd_scan(struct cmd_t *cmd, int from);
+
+int builtin_quit(char **argv);
+int builtin_jobs(char **argv);
+int builtin_bgfg(char **argv);
+int builtin_kill(char **argv);
+int builtin_alias(char **argv);
+int builtin_unalias(char **argv);
+int builtin_function(char **argv);
+int builtin_repeat(char **argv);
+int builtin_for(char **argv);
+int builtin_export(char **argv);
+int builtin_unset(char **argv);
+int defers_expansion(char *word);
+
+struct def_t *finddef(char *name);
+int adddef(char *name, char *body, int is_func);
+void cleardef(struct def_t *def);
+int positional(char *tok);
+void expand_def(struct def_t *def, struct cmd_t *cmd);
+void join_args(char **argv, char *out);
+void listdefs(void);
+
+char *save_tokens(char **argv, int argc, char **out, char *store, char *end);
+void prepare_cmd(char **argv, int argc, struct cmd_t *cmd, char *cmdline);
+void run_cmd(struct cmd_t *cmd, char *cmdline);
+double elapsed_ms(struct timespec *start, struct timespec *end);
+
+void load_vars(void);
+struct var_t *findvar(const char *name, int len);
+char *getvar(const char *name, int len);
+void putvar(char *entry, int exported);
+void setvar(char *assignment, int exported);
+void unsetvar(char *name);
+char **current_envp(void);
+char **overlay_envp(char **base, char **assigns, int n);
+int is_assignment(char *word);
+int var_name_len(const char *p);
+int is_literal(char *tok);
+char *expand_word(char *word, char **arena, char *end);
+void expand_tokens(struct cmd_t *cmd, char *arena, int size);
+
+char *cache_dir(void);
+int cache_key(char **argv, int argc, char **inputs, int ninputs,
+              char **names, int nnames, char *key);
+int cache_open(char *path, char *key, int len);
+int cache_age(const void *a, const void *b);
+void cache_evict(char *dir);
+void cache_replay(int fd, struct cmd_t *cmd, int end, char *cmdline);
+void run_cached(struct cmd_t *prepared, int command_bg, char *cmdline);
+void start_cmd(struct cmd_t *cmd, int command_bg, char *cmdline);
+
+int history_open(void);
+void history_add(char *cmdline);
+int history_flush(int wait);
+void history_close(void);
+int history_map(void);
+int history_get(int n, char **text);
+int history_find(char *key, int substring);
+unsigned trigram(char *s);
+void history_index(size_t n, char *line, int len);
+void history_reindex(size_t from, size_t count);
+int history_expand(char *cmdline);
+int builtin_history(char **argv);
+void collect_heredocs(char **argv);
+int find_heredoc(char *tok);
+void move_heredoc(char *from, char *to);
+void close_heredocs(void);
+int read_body_line(char *line);
+int memfd_from(const char *data, int len);
+char *process_subst(char ***argvp);
+int is_procsub(char *word);
+void close_procsubs(void);
+
+int readline_buf(struct linebuf_t *lb, char *line);
+int fill_buf(struct linebuf_t *lb);
+int next_cmdline(char *cmdline);
+void ctl_open(char *path);
+void ctl_accept(void);
+void ctl_service(struct linebuf_t *client);
+void ctl_eval(int fd, char *cmdline);
+void ctl_close(void);
+int ctl_stale(struct sockaddr_un *addr);
 /*
  * main - The shell's main routine
  */
@@ -97,13 +363,19 @@ int main(int argc, char **argv) {
     char c;
     char cmdline[MAXLINE];
     int emit_prompt = 1; /* emit prompt (default) */
+    struct timespec cpu;       /* CPU time used before main */
+    struct timespec phases[4]; /* main, signals, init, first prompt */
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    clock_gettime(CLOCK_MONOTONIC, &phases[0]);
+    atexit(oflush);
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(STDOUT_FILENO, STDERR_FILENO);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != -1) {
+    while ((c = getopt(argc, argv, "hvpTs:J:")) != -1) {
         switch (c) {
             case 'h':             /* print help message */
                 usage();
@@ -114,11 +386,23 @@ int main(int argc, char **argv) {
             case 'p':             /* don't print a prompt */
                 emit_prompt = 0;  /* handy for automatic testing */
                 break;
+            case 'T':             /* report startup phase times */
+                time_startup = 1;
+                break;
+            case 's':             /* accept commands on a control socket */
+                ctl_path = optarg;
+                break;
+            case 'J':             /* keep a job journal, adopting old jobs */
+                journal_path = optarg;
+                break;
             default:
                 usage();
         }
     }
 
+    /* Interactive shells keep history; others only if asked to */
+    hist_enabled = emit_prompt || getenv("TSH_HISTFILE") != NULL;
+
     /* Install the signal handlers */
 
     Signal(SIGUSR1, sigusr1_handler); /* Child is ready */
@@ -130,28 +414,52 @@ int main(int argc, char **argv) {
 
     /* This one provides a clean way to kill the shell */
     Signal(SIGQUIT, sigquit_handler);
+    clock_gettime(CLOCK_MONOTONIC, &phases[1]);
+
+    /*
+     * Nothing else is set up ahead of time: the job list is static and
+     * so starts out cleared, and variables, history and stdio buffers
+     * are created on first use.
+     */
 
-    /* Initialize the job list */
-    initjobs(jobs);
+    /* Open the control socket, if one was requested */
+    if (ctl_path)
+        ctl_open(ctl_path);
+
+    /* Replay the job journal, if one was requested */
+    if (journal_path)
+        journal_open(journal_path);
+    clock_gettime(CLOCK_MONOTONIC, &phases[2]);
 
     /* Execute the shell's read/eval loop */
     while (1) {
 
         /* Read command line */
-        if (emit_prompt) {
-            printf("%s", prompt);
-            fflush(stdout);
-        }
-        if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-            app_error("fgets error");
-        if (feof(stdin)) { /* End of file (ctrl-d) */
-            fflush(stdout);
+        if (emit_prompt)
+            oprintf("%s", prompt);
+        if (time_startup) {
+            oflush(); /* the first prompt counts once it's written */
+            clock_gettime(CLOCK_MONOTONIC, &phases[3]);
+            if (emit_prompt)
+                oprintf("\n");
+            startup_report(&cpu, phases);
+            time_startup = 0;
+            if (emit_prompt)
+                oprintf("%s", prompt);
+        }
+        if (!next_cmdline(cmdline)) /* End of file (ctrl-d) */
             exit(0);
+
+        /* Expand !-references and record the line */
+        if (hist_enabled) {
+            if (history_expand(cmdline) < 0)
+                continue;
+            history_add(cmdline);
         }
 
-        /* Evaluate the command line */
+        /* Evaluate the command line; output is flushed before the
+         * shell next blocks, not after every line */
         eval(cmdline);
-        fflush(stdout);
     }
 
     exit(0); /* control never reaches here */
@@ -160,7 +468,7 @@ int main(int argc, char **argv) {
 /*
  * eval - Evaluate the command line that the user has just typed in
  *
- * If the user has requested a built-in command (quit, jobs, bg or fg)
+ * If the user has requested a built-in command (quit, jobs, bg, fg, ...)
  * then execute it immediately. Otherwise, fork a child process and
  * run the job in the context of the child. If the job is running in
  * the foreground, wait for it to terminate and then return.  Note:
@@ -169,19 +477,18 @@ int main(int argc, char **argv) {
  * when we type ctrl-c (ctrl-z) at the keyboard.
 */
 void eval(char *cmdline) {
-    int command_bg, argc;
-    char *argv[MAXARGS];
+    int command_bg;
+    struct cmd_t cmd;
+    struct def_t *def;
     char buf[MAXLINE];
-
-    pid_t current_pid;
-    sigset_t initial_maks;
-    sigset_t old_mask;
+    char arena[MAXLINE];
+    int i;
 
     strcpy(buf, cmdline);
-    argc = parseline(buf, argv);
+    cmd.argc = parseline(buf, cmd.argv);
 
-    if (argc > 0) {
-        char lastArgFirstChar = *argv[argc - 1];
+    if (cmd.argc > 0) {
+        char lastArgFirstChar = *cmd.argv[cmd.argc - 1];
         if (lastArgFirstChar == '&') {
             command_bg = 1;
         } else {
@@ -191,91 +498,187 @@ void eval(char *cmdline) {
         command_bg = 0;
     }
 
-    if (argv[0] == NULL)
+    if (cmd.argv[0] == NULL)
         return;
 
+    if (command_bg)
+        cmd.argv[--cmd.argc] = NULL;
 
-    int isBuiltIn = builtin_cmd(argv);
-    if (isBuiltIn == 0) {
-        int pipe_counter = total_num_pipes(argv);
-        int pipefds[2 * pipe_counter];
-        pid_t pids[pipe_counter + 1];
+    /* Aliases and functions come pre-tokenized and pre-scanned */
+    if ((def = finddef(cmd.argv[0])) != NULL) {
+        expand_def(def, &cmd);
+        expand_tokens(&cmd, arena, MAXLINE);
+    } else {
+        cmd.pipes = total_num_pipes(cmd.argv);
+        cmd.plain = 0;
+    }
 
-        int i = 0;
-        while (i < pipe_counter) {
-            int pipe_index = i * 2;
-            if (pipe(pipefds + pipe_index) < 0) {
-                unix_error("Issue caused by pipe error");
-            }
-            i = i + 1;
-        }
+    /* A line of nothing but NAME=value words sets shell variables */
+    for (i = 0; i < cmd.argc && is_assignment(cmd.argv[i]); i++)
+        ;
+    if (i == cmd.argc) {
+        for (i = 0; i < cmd.argc; i++)
+            setvar(cmd.argv[i], 0);
+        return;
+    }
 
-        int i2 = 0;
-        while (i2 <= pipe_counter) {
-            char *part_argv[MAXARGS];
+    collect_heredocs(cmd.argv);
+
+    int isBuiltIn = builtin_cmd(cmd.argv);
+    if (isBuiltIn == 0)
+        start_cmd(&cmd, command_bg, cmdline);
+    close_heredocs();
+}
+
+/* start_cmd - Run a command that isn't a builtin, honoring "cached" */
+void start_cmd(struct cmd_t *cmd, int command_bg, char *cmdline) {
+    if (strcmp(cmd->argv[0], "cached") == 0)
+        run_cached(cmd, command_bg, cmdline);
+    else
+        launch_cmd(cmd, command_bg, cmdline);
+}
 
-            int fl_input, fl_output;
-            sectioning_pipe(argv, part_argv, &fl_input, &fl_output, i2, pipe_counter);
+/*
+ * launch_cmd - Fork and exec each stage of a tokenized pipeline, add it
+ *     to the job list and, for a foreground job, wait for it. If the
+ *     command is plain (no redirections) the stages are cut straight
+ *     from the precomputed offsets instead of going through
+ *     sectioning_pipe. Returns the pid of the first stage.
+ */
+pid_t launch_cmd(struct cmd_t *cmd, int command_bg, char *cmdline) {
+    pid_t current_pid;
+    sigset_t initial_maks;
+    sigset_t old_mask;
 
-            sigprocmask(SIG_BLOCK, &initial_maks, &old_mask);
+    sigemptyset(&initial_maks);
+    sigaddset(&initial_maks, SIGCHLD);
 
+    int pipe_counter = cmd->pipes;
+    int pipefds[2 * pipe_counter];
+    pid_t pids[pipe_counter + 1];
+    char **envp = current_envp();
+    pids[0] = 0;
 
-            if ((current_pid = fork()) == 0) {
-                setpgid(0, 0);
-                getting_redirect(fl_input, fl_output, i2, pipe_counter, pipefds);
+    int i = 0;
+    while (i < pipe_counter) {
+        int pipe_index = i * 2;
+        if (pipe2(pipefds + pipe_index, O_CLOEXEC) < 0) {
+            unix_error("Issue caused by pipe error");
+        }
+        i = i + 1;
+    }
 
-                int term_ind = 0;
-                while (term_ind < 2 * pipe_counter) {
-                    close(pipefds[term_ind]);
-                    term_ind = term_ind + 1;
-                }
+    int i2 = 0;
+    while (i2 <= pipe_counter) {
+        char *part_argv[MAXARGS];
+
+        int fl_input, fl_output;
+        if (cmd->plain) {
+            int start = cmd->stage[i2];
+            int end = (i2 < pipe_counter) ? cmd->stage[i2 + 1] - 1 : cmd->argc;
+            memcpy(part_argv, cmd->argv + start, (end - start) * sizeof(char *));
+            part_argv[end - start] = NULL;
+            fl_input = -1;
+            fl_output = -1;
+        } else {
+            sectioning_pipe(cmd->argv, part_argv, &fl_input, &fl_output, i2, pipe_counter);
+        }
 
-                sigprocmask(SIG_SETMASK, &old_mask, NULL);
-                if (command_bg) {
-                    part_argv[argc-1] = NULL;
-                }
+        sigprocmask(SIG_BLOCK, &initial_maks, &old_mask);
 
-                int condition_execution;
-                condition_execution = execvp(part_argv[0], part_argv);
-                if (condition_execution < 0) {
-                    printf("%s: No expected command found\n", part_argv[0]);
-                    exit(0);
-                }
+        oflush(); /* or the child could write first, or write it twice */
+        if ((current_pid = fork()) == 0) {
+            setpgid(0, 0);
+            if (ctl_fd >= 0)
+                Signal(SIGPIPE, SIG_DFL);
+            getting_redirect(fl_input, fl_output, i2, pipe_counter, pipefds);
 
-            } else if (current_pid < 0) {
-                unix_error("Encountered a Fork error");
-            } else {
-                if (i2 == 0) {
-                    int jobType = command_bg ? BG : FG;
-                    addjob(jobs, current_pid, jobType, cmdline);
-                }
-                pids[i2] = current_pid;
+            int term_ind = 0;
+            while (term_ind < 2 * pipe_counter) {
+                close(pipefds[term_ind]);
+                term_ind = term_ind + 1;
             }
 
             sigprocmask(SIG_SETMASK, &old_mask, NULL);
-            i2 = i2 + 1;
-        }
 
+            /* NAME=value prefixes apply to this command only */
+            int nassign = 0;
+            while (part_argv[nassign] && part_argv[nassign + 1] && is_assignment(part_argv[nassign]))
+                nassign = nassign + 1;
+            environ = overlay_envp(envp, part_argv, nassign);
+
+            int condition_execution;
+            condition_execution = execvp(part_argv[nassign], part_argv + nassign);
+            if (condition_execution < 0) {
+                /* _exit: the shell's atexit handlers (control socket,
+                 * history, output buffer) belong to the shell alone */
+                oprintf("%s: No expected command found\n", part_argv[nassign]);
+                oflush();
+                _exit(127);
+            }
 
-        int position_index = 0;
-        while (position_index < 2 * pipe_counter) {
-            close(pipefds[position_index]);
-            position_index = position_index + 1;
+        } else if (current_pid < 0) {
+            unix_error("Encountered a Fork error");
+        } else {
+            /* Set the group here too, so a signal sent before the child
+             * gets to run still finds it */
+            setpgid(current_pid, current_pid);
+            if (i2 == 0) {
+                int jobType = command_bg ? BG : FG;
+                addjob(jobs, current_pid, jobType, cmdline);
+            }
+            pids[i2] = current_pid;
+            if (fl_input != -1)
+                close(fl_input);
+            if (fl_output != -1)
+                close(fl_output);
+            close_procsubs();
         }
 
-        if (!command_bg) {
-            int index_jb = 0;
-            while (index_jb <= pipe_counter) {
-                waitfg(pids[index_jb]);
-                index_jb = index_jb + 1;
-            }
-        } else {
-            int jobId = pid2jid(pids[0]);
-            printf("[%d] (%d) %s", jobId, pids[0], cmdline);
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        i2 = i2 + 1;
+    }
+
+
+    int position_index = 0;
+    while (position_index < 2 * pipe_counter) {
+        close(pipefds[position_index]);
+        position_index = position_index + 1;
+    }
+
+    if (!command_bg) {
+        int index_jb = 0;
+        while (index_jb <= pipe_counter) {
+            waitfg(pids[index_jb]);
+            index_jb = index_jb + 1;
         }
+    } else {
+        int jobId = pid2jid(pids[0]);
+        oprintf("[%d] (%d) %s", jobId, pids[0], cmdline);
     }
+    return pids[0];
 }
 
+/*
+ * cmd_scan - Count the pipes in cmd's tokens from index `from` on,
+ *     recording where each stage starts and whether any redirection
+ *     operators appear. Earlier tokens must already have been scanned.
+ */
+void cmd_scan(struct cmd_t *cmd, int from) {
+    int i;
+
+    if (from == 0) {
+        cmd->pipes = 0;
+        cmd->plain = 1;
+        cmd->stage[0] = 0;
+    }
+    for (i = from; i < cmd->argc; i++) {
+        if (strcmp(cmd->argv[i], "|") == 0)
+            cmd->stage[++cmd->pipes] = i + 1;
+        else if (cmd->argv[i][0] == '<' || cmd->argv[i][0] == '>')
+            cmd->plain = 0;
+    }
+}
 
 
 void getting_redirect(int fl_input, int fl_output, int i2, int pipe_counter, int *pipefds) {
@@ -317,25 +720,49 @@ void sectioning_pipe(char **argv, char **argv_sec, int *file_inpt, int *file_opt
             }
 
         } else if (position_idx == index) {
-            if (strcmp(*argv, "<") == 0) {
+            if (strncmp(*argv, "<<<", 3) == 0) {
+                /* here-string: the word plus a trailing newline */
+                char *word = (*argv)[3] ? *argv + 3 : argv[1];
+                if (!word) {
+                    oprintf("<<<: Missing word\n");
+                    break;
+                }
+                if (!(*argv)[3])
+                    argv = argv + 1;
+                int word_len = strlen(word);
+                char data[word_len + 1];
+                memcpy(data, word, word_len);
+                data[word_len] = '\n';
+                *file_inpt = memfd_from(data, word_len + 1);
+            } else if (strncmp(*argv, "<<", 2) == 0) {
+                /* here-doc: the body was collected by eval */
+                *file_inpt = find_heredoc(*argv);
+                if (!(*argv)[2] && argv[1])
+                    argv = argv + 1;
+            } else if (is_procsub(*argv)) {
+                argv_sec[placement_arg] = process_subst(&argv);
+                placement_arg = placement_arg + 1;
+            } else if (strcmp(*argv, "<") == 0) {
                 checking = checking + 1;
                 argv = argv + 1;
-                FILE *final_input = fopen(*argv, "r");
-                if (!final_input) {
+                char *target = is_procsub(*argv) ? process_subst(&argv) : *argv;
+                int final_input = open(target, O_RDONLY | O_CLOEXEC);
+                if (final_input < 0) {
                     perror("given fopen error");
                     exit(1);
                 }
-                *file_inpt = fileno(final_input);
+                *file_inpt = final_input;
             } else {
                 if (strcmp(*argv, ">") == 0) {
                     checking = checking + 1;
                     argv = argv + 1;
-                    FILE *final_output = fopen(*argv, "w");
-                    if (!final_output) {
+                    char *target = is_procsub(*argv) ? process_subst(&argv) : *argv;
+                    int final_output = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+                    if (final_output < 0) {
                         perror("given fopen error");
                         exit(1);
                     }
-                    *file_opt = fileno(final_output);
+                    *file_opt = final_output;
                 } else {
 
                     argv_sec[placement_arg] = *argv;
@@ -350,6 +777,216 @@ void sectioning_pipe(char **argv, char **argv_sec, int *file_inpt, int *file_opt
     argv_sec[placement_arg] = NULL;
 }
 
+/*
+ * collect_heredocs - Read the body of every "<<DELIM" (or "<< DELIM")
+ *     in argv from the current input source, up to a line holding just
+ *     DELIM, and park each body in a memfd for sectioning_pipe to use.
+ *     Bodies are never expanded, so a quoted DELIM ('EOF' or "EOF")
+ *     just has its quotes removed.
+ */
+void collect_heredocs(char **argv) {
+    char line[MAXLINE], delim[MAXLINE];
+    char *word, *body;
+    int i, len, size, line_len, delim_len;
+
+    for (i = 0; argv[i]; i++) {
+        if (strncmp(argv[i], "<<", 2) != 0 || argv[i][2] == '<')
+            continue;
+        word = argv[i][2] ? argv[i] + 2 : argv[i + 1];
+        if (!word)
+            continue;
+        delim_len = strlen(word);
+        if (delim_len >= 2 && (word[0] == '\'' || word[0] == '"') &&
+            word[delim_len - 1] == word[0]) {
+            word = word + 1;
+            delim_len = delim_len - 2;
+        }
+        if (delim_len >= MAXLINE)
+            delim_len = MAXLINE - 1;
+        memcpy(delim, word, delim_len);
+        delim[delim_len] = '\0';
+
+        len = 0;
+        size = MAXLINE;
+        body = malloc(size);
+        while (read_body_line(line)) {
+            line_len = strlen(line);
+            if (line_len == delim_len + 1 && line[delim_len] == '\n' &&
+                strncmp(line, delim, delim_len) == 0)
+                break;
+            if (len + line_len > size) {
+                size = 2 * (len + line_len);
+                body = realloc(body, size);
+            }
+            memcpy(body + len, line, line_len);
+            len = len + line_len;
+        }
+        heredocs[num_heredocs].tok = argv[i];
+        heredocs[num_heredocs].fd = memfd_from(body, len);
+        num_heredocs = num_heredocs + 1;
+        free(body);
+    }
+}
+
+/*
+ * find_heredoc - Return a rewound descriptor for the body collected for
+ *     the << token tok, or -1. The body itself stays available, so a
+ *     command that is run repeatedly gets it every time.
+ */
+int find_heredoc(char *tok) {
+    int i, fd;
+
+    for (i = 0; i < num_heredocs; i++) {
+        if (heredocs[i].tok == tok) {
+            if ((fd = fcntl(heredocs[i].fd, F_DUPFD_CLOEXEC, 0)) < 0)
+                unix_error("dup error");
+            lseek(fd, 0, SEEK_SET);
+            return fd;
+        }
+    }
+    return -1;
+}
+
+/* move_heredoc - The << token from has been copied to to: follow it */
+void move_heredoc(char *from, char *to) {
+    int i;
+
+    for (i = 0; i < num_heredocs; i++)
+        if (heredocs[i].tok == from)
+            heredocs[i].tok = to;
+}
+
+/* close_heredocs - Release the bodies collected for the last command */
+void close_heredocs(void) {
+    while (num_heredocs > 0) {
+        num_heredocs = num_heredocs - 1;
+        close(heredocs[num_heredocs].fd);
+    }
+}
+
+/*
+ * read_body_line - Read one more line from whichever source the command
+ *     line being evaluated came from. Returns 0 at EOF.
+ */
+int read_body_line(char *line) {
+    while (cur_input->fd >= 0) {
+        if (readline_buf(cur_input, line))
+            return 1;
+        if (fill_buf(cur_input) <= 0)
+            return 0;
+    }
+    return 0;
+}
+
+/*
+ * memfd_from - Return an anonymous in-memory file holding data, rewound
+ *     so it can be handed straight to a child as stdin. Nothing is
+ *     created on the filesystem.
+ */
+int memfd_from(const char *data, int len) {
+    int fd, n;
+
+    if ((fd = memfd_create("tsh-heredoc", MFD_CLOEXEC)) < 0)
+        unix_error("memfd_create error");
+    while (len > 0) {
+        if ((n = write(fd, data, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("memfd write error");
+        }
+        data = data + n;
+        len = len - n;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/*
+ * process_subst - Start the command in a "<(cmd args)" or ">(cmd args)"
+ *     word that begins at **argvp, leaving *argvp on its last token.
+ *     Returns a /dev/fd/N name for the pipe end the job should open;
+ *     the parent's copy is closed by close_procsubs after the fork.
+ *     The words are copied rather than trimmed in place, since they
+ *     may be the cached tokens of a function or loop body.
+ */
+char *process_subst(char ***argvp) {
+    static char names[MAXARGS][16];
+    char *sub_argv[MAXARGS];
+    char words[MAXLINE];
+    char **envp;
+    int used = 0;
+    char **argv = *argvp;
+    char *word = *argv + 2;
+    int reading = (**argv == '<');
+    int sub_argc = 0;
+    int fds[2];
+    int len, last;
+    pid_t pid;
+
+    while (1) {
+        len = strlen(word);
+        last = (len > 0 && word[len - 1] == ')') || !argv[1];
+        if (len > 0 && word[len - 1] == ')')
+            len = len - 1;
+        if (len > 0 && used + len < MAXLINE) {
+            memcpy(words + used, word, len);
+            words[used + len] = '\0';
+            sub_argv[sub_argc++] = words + used;
+            used = used + len + 1;
+        }
+        if (last)
+            break;
+        argv = argv + 1;
+        word = *argv;
+    }
+    sub_argv[sub_argc] = NULL;
+    *argvp = argv;
+
+    if (sub_argc == 0 || num_procsubs == MAXARGS) {
+        oprintf("Bad process substitution\n");
+        return "/dev/null";
+    }
+
+    if (pipe(fds) < 0)
+        unix_error("Issue caused by pipe error");
+
+    envp = current_envp();
+    oflush();
+    if ((pid = fork()) == 0) {
+        setpgid(0, 0);
+        if (ctl_fd >= 0)
+            Signal(SIGPIPE, SIG_DFL);
+        dup2(fds[reading ? 1 : 0], reading ? STDOUT_FILENO : STDIN_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        environ = envp;
+        execvp(sub_argv[0], sub_argv);
+        oprintf("%s: No expected command found\n", sub_argv[0]);
+        oflush();
+        _exit(127);
+    } else if (pid < 0) {
+        unix_error("Encountered a Fork error");
+    }
+
+    close(fds[reading ? 1 : 0]);
+    procsub_fds[num_procsubs] = fds[reading ? 0 : 1];
+    sprintf(names[num_procsubs], "/dev/fd/%d", procsub_fds[num_procsubs]);
+    return names[num_procsubs++];
+}
+
+/* is_procsub - Does this word start a process substitution? */
+int is_procsub(char *word) {
+    return word && (word[0] == '<' || word[0] == '>') && word[1] == '(';
+}
+
+/* close_procsubs - Drop the parent's ends of process substitution pipes */
+void close_procsubs(void) {
+    while (num_procsubs > 0) {
+        num_procsubs = num_procsubs - 1;
+        close(procsub_fds[num_procsubs]);
+    }
+}
+
 
 int total_num_pipes(char **argv) {
     int tracker = 0;
@@ -371,14 +1008,40 @@ int total_num_pipes(char **argv) {
  * parseline - Parse the command line and build the argv array.
  *
  * Characters enclosed in single quotes are treated as a single
- * argument.  Return number of arguments parsed.
+ * argument, and are not subject to $NAME expansion.  Return number
+ * of arguments parsed.
  */
 int parseline(const char *cmdline, char **argv) {
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
+    static char array[MAXLINE + 1]; /* holds local copy of command line */
+    static char expanded[MAXLINE]; /* holds $-expanded args */
+    char *arena = expanded;     /* next free byte in expanded */
+    int argc;                   /* number of args */
+    int i;
+
+    argc = split_line(cmdline, array, argv);
+
+    /* Expand $NAME in unquoted args, except in bodies that are stored
+     * for later (loops, aliases, functions): those expand when run */
+    if (argc > 0 && !defers_expansion(argv[0])) {
+        for (i = 0; i < argc; i++)
+            if (!is_literal(argv[i]))
+                argv[i] = expand_word(argv[i], &arena, expanded + MAXLINE);
+    }
+
+    return argc;
+}
+
+/*
+ * split_line - Copy cmdline into buf (MAXLINE + 1 bytes) and split it
+ *     into argv in place, without expanding anything. buf[0] is left
+ *     as padding, so every token has a byte before it, which is '\''
+ *     for a single-quoted token. Returns the number of tokens.
+ */
+int split_line(const char *cmdline, char *buf, char **argv) {
     char *delim;                /* points to space or quote delimiters */
     int argc;                   /* number of args */
 
+    *buf++ = ' ';
     strcpy(buf, cmdline);
     buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
     while (*buf && (*buf == ' ')) /* ignore leading spaces */
@@ -410,34 +1073,85 @@ int parseline(const char *cmdline, char **argv) {
         }
     }
     argv[argc] = NULL;
-
     return argc;
 }
 
+/* defers_expansion - Does a command starting with word store its body? */
+int defers_expansion(char *word) {
+    int len = strlen(word);
+
+    return strcmp(word, "for") == 0 || strcmp(word, "repeat") == 0 ||
+           strcmp(word, "alias") == 0 ||
+           strcmp(word, "function") == 0 ||
+           (len > 2 && strcmp(word + len - 2, "()") == 0);
+}
+
+/*
+ * builtins - The builtin command registry. Each entry returns 1 if it
+ *     handled the command, or 0 to let it run as a program instead.
+ */
+struct builtin_t builtins[] = {
+    {"quit",     builtin_quit},
+    {"jobs",     builtin_jobs},
+    {"bg",       builtin_bgfg},
+    {"fg",       builtin_bgfg},
+    {"kill",     builtin_kill},
+    {"alias",    builtin_alias},
+    {"unalias",  builtin_unalias},
+    {"function", builtin_function},
+    {"repeat",   builtin_repeat},
+    {"for",      builtin_for},
+    {"export",   builtin_export},
+    {"unset",    builtin_unset},
+    {"history",  builtin_history},
+    {NULL,       NULL}
+};
+
 /*
  * builtin_cmd - If the user has typed a built-in command then execute
  * it immediately.
  */
 int builtin_cmd(char **argv) {
-    int condition_one, condition_two;
-    int final = 0;
+    struct builtin_t *b;
+    int len;
+
     if (argv[0] == NULL) {
         return 1;
     }
-    if (strcmp(argv[0], "quit") == 0) {
-        exit(0);
-    } else if (strcmp(argv[0], "jobs") == 0) {
-        listjobs(jobs);
-        final = 1;
-    } else{
-        condition_one = strcmp(argv[0], "bg");
-        condition_two = strcmp(argv[0], "fg");
-        if (condition_one == 0 || condition_two == 0){
-            do_bgfg(argv);
-            final = 1;
-        }
+
+    len = strlen(argv[0]);
+    if (len > 2 && strcmp(argv[0] + len - 2, "()") == 0)
+        return builtin_function(argv);
+
+    for (b = builtins; b->name; b++)
+        if (strcmp(argv[0], b->name) == 0)
+            return b->run(argv);
+    return 0;
+}
+
+int builtin_quit(char **argv) {
+    exit(0);
+}
+
+int builtin_jobs(char **argv) {
+    adopted_refresh();
+    listjobs(jobs);
+    return 1;
+}
+
+int builtin_bgfg(char **argv) {
+    do_bgfg(argv);
+    return 1;
+}
+
+/* builtin_kill - Only the %jobid forms are ours; pids go to /bin/kill */
+int builtin_kill(char **argv) {
+    if (argv[1] && (argv[1][0] == '%' ||
+                    (argv[1][0] == '-' && argv[2] && argv[2][0] == '%'))) {
+        do_kill(argv);
+        return 1;
     }
-    return final;
+    return 0;
 }
 
 /*
@@ -447,24 +1161,25 @@ int builtin_cmd(char **argv) {
 void do_bgfg(char **argv) {
     struct job_t *placement = NULL;
     if (!argv[1]) {
-        printf("%s PID is needed for such %%jobid argument\n", argv[0]);
+        oprintf("%s PID is needed for such %%jobid argument\n", argv[0]);
         return;
     }
 
+    adopted_refresh();
     placement = checkingType(argv[1], jobs);
     if (!placement) {
 
         if (argv[1][0] == '%') {
-            printf("%s:Job was not found\n", argv[1]);
+            oprintf("%s:Job was not found\n", argv[1]);
         } else if (isdigit(argv[1][0])) {
-            printf("%s: Given process was not encountered\n", argv[1]);
+            oprintf("%s: Given process was not encountered\n", argv[1]);
         } else {
-            printf("%s: The given argument needs to be a PID or a given %%jobid\n", argv[1]);
+            oprintf("%s: The given argument needs to be a PID or a given %%jobid\n", argv[1]);
         }
         return;
     }
 
-    kill(-(placement->pid), SIGCONT);
+    kill(-(placement->pgid), SIGCONT);
 
     int condition_bg = !strcmp(argv[0], "bg");
     int condition_fg = !strcmp(argv[0], "fg");
@@ -472,15 +1187,46 @@ void do_bgfg(char **argv) {
     if (condition_bg || condition_fg) {
         if (condition_bg) {
             placement->state = BG;
-            printf("[%d] (%d) %s", placement->jid, placement->pid, placement->cmdline);
+            journal(J_STATE, placement);
+            oprintf("[%d] (%d) %s", placement->jid, placement->pid, jobcmd(placement));
         } else {
             placement->state = FG;
+            journal(J_STATE, placement);
             waitfg(placement->pid);
         }
     }
 }
 
 
+/*
+ * do_kill - Execute the builtin kill command: kill [-signo] %jobid ...
+ *
+ * Job-id forms are handled here so that control socket clients can
+ * manage jobs by jid; anything else falls through to /bin/kill.
+ */
+void do_kill(char **argv) {
+    int signo = SIGTERM;
+    struct job_t *placement;
+
+    argv = argv + 1;
+    if ((*argv)[0] == '-') {
+        signo = atoi(&(*argv)[1]);
+        argv = argv + 1;
+    }
+
+    while (*argv) {
+        placement = checkingType(*argv, jobs);
+        if (!placement) {
+            oprintf("%s:Job was not found\n", *argv);
+        } else {
+            if (kill(-(placement->pgid), signo) < 0)
+                oprintf("%s: %s\n", *argv, strerror(errno));
+        }
+        argv = argv + 1;
+    }
+}
+
+
 struct job_t* checkingType(char *arg, struct job_t *total_job) {
     struct job_t *placement = NULL;
     if (arg[0] == '%') {
@@ -499,6 +1245,11 @@ struct job_t* checkingType(char *arg, struct job_t *total_job) {
 
 
 void waitfg(pid_t pid) {
+    oflush();
+    if (find_adopted(pid) >= 0) {
+        wait_adopted(pid); /* not our child: no SIGCHLD will come */
+        return;
+    }
 
     int condition = 1;
     while (condition) {
@@ -558,12 +1309,15 @@ void sigchld_handler(int sig) {
                 if (!WIFSTOPPED(state)) {
                     int wasExited = WIFEXITED(state);
                     if (WIFSIGNALED(state)) {
-                        printf("Job [%d] (%d) was terminated due to the following  signal %d\n", pid2jid(tracking_pid), tracking_pid, WTERMSIG(state));
+                        notify(placement, "Job [%d] (%d) was terminated due to the following  signal %d\n", pid2jid(tracking_pid), tracking_pid, WTERMSIG(state));
                     } else if (wasExited) {}
+                    exit_pid = tracking_pid;
+                    exit_status = state;
                     deletejob(jobs, tracking_pid);
                 } else {
                     placement->state = ST;
-                    printf("Job [%d] (%d) was halted due to the following signal %d\n", pid2jid(tracking_pid), tracking_pid, WSTOPSIG(state));
+                    journal(J_STATE, placement);
+                    notify(placement, "Job [%d] (%d) was halted due to the following signal %d\n", pid2jid(tracking_pid), tracking_pid, WSTOPSIG(state));
                 }
             }
             sigprocmask(SIG_SETMASK, &old_msks, NULL);
@@ -614,24 +1368,121 @@ void sigusr1_handler(int sig) {
  * End signal handlers
  *********************/
 
+/***********************************************
+ * Interned command lines
+ **********************************************/
+
+/* strhash - FNV-1a hash of a string */
+unsigned strhash(const char *s) {
+    unsigned h = 2166136261u;
+
+    while (*s) {
+        h = h ^ (unsigned char)*s++;
+        h = h * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * intern - Return a handle for text, adding a reference. Identical
+ *     command lines share one copy in strarena. Called with SIGCHLD
+ *     blocked, since release may run from the handler.
+ */
+int intern(const char *text) {
+    unsigned hash = strhash(text);
+    unsigned bucket = hash % NBUCKETS;
+    int len = strlen(text) + 1;
+    int h;
+
+    for (h = buckets[bucket]; h; h = istrs[h].next) {
+        if (istrs[h].hash == hash && strcmp(strarena + istrs[h].off, text) == 0) {
+            istrs[h].refs = istrs[h].refs + 1;
+            return h;
+        }
+    }
+
+    if (arena_dead > arena_used / 2 && arena_used > MAXLINE)
+        compact_arena();
+    if (arena_used + len > arena_size) {
+        arena_size = 2 * (arena_used + len);
+        strarena = realloc(strarena, arena_size);
+    }
+
+    if (free_istr) {
+        h = free_istr;
+        free_istr = istrs[h].next;
+    } else {
+        if (num_istrs + 1 >= max_istrs) {
+            max_istrs = max_istrs ? 2 * max_istrs : MAXJOBS + 1;
+            istrs = realloc(istrs, max_istrs * sizeof(struct istr_t));
+        }
+        h = ++num_istrs;  /* handle 0 means "no string" */
+    }
+
+    istrs[h].hash = hash;
+    istrs[h].refs = 1;
+    istrs[h].off = arena_used;
+    istrs[h].len = len;
+    istrs[h].next = buckets[bucket];
+    buckets[bucket] = h;
+    memcpy(strarena + arena_used, text, len);
+    arena_used = arena_used + len;
+    return h;
+}
+
+/*
+ * release - Drop a reference to an interned string. Its bytes are
+ *     only reclaimed by a later compact_arena, never moved here, so
+ *     this is safe to call from the SIGCHLD handler.
+ */
+void release(int h) {
+    int *link;
+
+    if (h == 0 || --istrs[h].refs > 0)
+        return;
+    for (link = &buckets[istrs[h].hash % NBUCKETS]; *link != h; link = &istrs[*link].next)
+        ;
+    *link = istrs[h].next;
+    istrs[h].next = free_istr;
+    free_istr = h;
+    arena_dead = arena_dead + istrs[h].len;
+}
+
+/* compact_arena - Slide live strings down over released ones */
+void compact_arena(void) {
+    char *old = strarena;
+    int h, used = 0;
+
+    strarena = malloc(arena_size);
+    for (h = 1; h <= num_istrs; h++) {
+        if (istrs[h].refs > 0) {
+            memcpy(strarena + used, old + istrs[h].off, istrs[h].len);
+            istrs[h].off = used;
+            used = used + istrs[h].len;
+        }
+    }
+    free(old);
+    arena_used = used;
+    arena_dead = 0;
+}
+
+/* jobcmd - The command line of a job */
+char *jobcmd(struct job_t *job) {
+    return job->cmd ? strarena + istrs[job->cmd].off : "";
+}
+
 /***********************************************
  * Helper routines that manipulate the job list
  **********************************************/
 
 /* clearjob - Clear the entries in a job struct */
 void clearjob(struct job_t *job) {
+    release(job->cmd);
     job->pid = 0;
+    job->pgid = 0;
     job->jid = 0;
     job->state = UNDEF;
-    job->cmdline[0] = '\0';
-}
-
-/* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs) {
-    int i;
-
-    for (i = 0; i < MAXJOBS; i++)
-        clearjob(&jobs[i]);
+    job->cmd = 0;
 }
 
 /* freejid - Returns smallest free job ID */
@@ -655,17 +1506,20 @@ int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) {
         return 0;
     int free = freejid(jobs);
     if (!free) {
-        printf("Tried to create too many jobs\n");
+        oprintf("Tried to create too many jobs\n");
         return 0;
     }
     for (i = 0; i < MAXJOBS; i++) {
         if (jobs[i].pid == 0) {
             jobs[i].pid = pid;
+            jobs[i].pgid = pid;
             jobs[i].state = state;
             jobs[i].jid = free;
-            strcpy(jobs[i].cmdline, cmdline);
+            jobs[i].cmd = intern(cmdline);
+            jobs[i].owner = out_owner;
+            journal(J_ADD, &jobs[i]);
             if(verbose){
-                printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
+                oprintf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobcmd(&jobs[i]));
             }
             return 1;
         }
@@ -682,6 +1536,7 @@ int deletejob(struct job_t *jobs, pid_t pid) {
 
     for (i = 0; i < MAXJOBS; i++) {
         if (jobs[i].pid == pid) {
+            journal(J_DEL, &jobs[i]);
             clearjob(&jobs[i]);
             return 1;
         }
@@ -743,22 +1598,22 @@ void listjobs(struct job_t *jobs) {
 
     for (i = 0; i < MAXJOBS; i++) {
         if (jobs[i].pid != 0) {
-            printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
+            oprintf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
             switch (jobs[i].state) {
                 case BG:
-                    printf("Running ");
+                    oprintf("Running ");
                     break;
                 case FG:
-                    printf("Foreground ");
+                    oprintf("Foreground ");
                     break;
                 case ST:
-                    printf("Stopped ");
+                    oprintf("Stopped ");
                     break;
                 default:
-                    printf("listjobs: Internal error: job[%d].state=%d ",
+                    oprintf("listjobs: Internal error: job[%d].state=%d ",
                            i, jobs[i].state);
             }
-            printf("%s", jobs[i].cmdline);
+            oprintf("%s", jobcmd(&jobs[i]));
         }
     }
 }
@@ -767,26 +1622,2161 @@ void listjobs(struct job_t *jobs) {
  ******************************/
 
 
-/***********************
- * Other helper routines
- ***********************/
+/**************************************
+ * Job journal
+ *
+ * With -J <file>, every addjob, deletejob and job state change is
+ * appended to a journal as one small record. A later tsh started with
+ * the same journal replays it, keeps the jobs whose processes are still
+ * alive (checked against their /proc start time, so a recycled pid
+ * isn't mistaken for the job) and manages them as its own. It can't
+ * wait() for processes it didn't fork, so it watches them through
+ * pidfds and /proc instead.
+ **************************************/
 
 /*
- * usage - print a help message and terminate
+ * journal_open - Replay the journal at path, re-adopt surviving jobs,
+ *     then replace the journal with a compacted one holding just those
+ *     jobs and keep it open for appending. The journal is locked while
+ *     this shell runs, so two shells never share one.
  */
-void usage(void) {
-    printf("Usage: shell [-hvp]\n");
-    printf("   -h   print this message\n");
-    printf("   -v   print additional diagnostic information\n");
-    printf("   -p   do not emit a command prompt\n");
-    exit(1);
+void journal_open(char *path) {
+    struct jrec_t rec;
+    struct stat st;
+    unsigned long long starts[MAXJOBS] = {0};
+    char tmp[MAXLINE + 16], cmd[MAXLINE];
+    char *data = NULL;
+    char state;
+    int fd, i, off = 0, pidfd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+        oprintf("%s: %s\n", path, strerror(errno));
+        return;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        oprintf("%s: Journal is in use by another shell\n", path);
+        close(fd);
+        return;
+    }
+
+    /* Replay: the whole journal in one read */
+    fstat(fd, &st);
+    if (st.st_size > 0 && (data = malloc(st.st_size)) != NULL &&
+        read(fd, data, st.st_size) != st.st_size)
+        st.st_size = 0;
+    while (data && off + (int)sizeof(rec) <= st.st_size) {
+        memcpy(&rec, data + off, sizeof(rec));
+        off = off + sizeof(rec);
+        if (rec.len < 0 || rec.len >= MAXLINE || off + rec.len > st.st_size)
+            break; /* torn last record */
+        for (i = 0; i < MAXJOBS && jobs[i].pid != rec.pid; i++)
+            ;
+        if (rec.op == J_ADD && i == MAXJOBS) {
+            for (i = 0; i < MAXJOBS && jobs[i].pid != 0; i++)
+                ;
+            if (i < MAXJOBS) {
+                memcpy(cmd, data + off, rec.len);
+                cmd[rec.len] = '\0';
+                jobs[i].pid = rec.pid;
+                jobs[i].pgid = rec.pid;
+                jobs[i].jid = rec.jid;
+                jobs[i].state = rec.state;
+                jobs[i].cmd = intern(cmd);
+                jobs[i].owner = -1;
+                starts[i] = rec.start;
+            }
+        } else if (rec.op == J_STATE && i < MAXJOBS) {
+            jobs[i].state = rec.state;
+        } else if (rec.op == J_DEL && i < MAXJOBS) {
+            clearjob(&jobs[i]);
+        }
+        off = off + rec.len;
+    }
+    free(data);
+
+    /* Keep the jobs that are still the same processes */
+    for (i = 0; i < MAXJOBS; i++) {
+        if (jobs[i].pid == 0)
+            continue;
+        if (proc_start(jobs[i].pid, &state) != starts[i] || state == 'Z') {
+            clearjob(&jobs[i]);
+            continue;
+        }
+        pidfd = syscall(SYS_pidfd_open, jobs[i].pid, 0);
+        adopted[num_adopted].pid = jobs[i].pid;
+        adopted[num_adopted].pidfd = pidfd;
+        adopted[num_adopted].start = starts[i];
+        num_adopted = num_adopted + 1;
+        if (jobs[i].state == FG) /* nobody is waiting for it now */
+            jobs[i].state = BG;
+        if (state == 'T')
+            jobs[i].state = ST;
+        oprintf("Restored job [%d] (%d) %s", jobs[i].jid, jobs[i].pid, jobcmd(&jobs[i]));
+    }
+
+    /* Compact: a fresh journal with one record per live job */
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    journal_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (journal_fd < 0 || flock(journal_fd, LOCK_EX | LOCK_NB) < 0) {
+        oprintf("%s: %s\n", tmp, strerror(errno));
+        if (journal_fd >= 0)
+            close(journal_fd);
+        journal_fd = -1;
+        close(fd);
+        return;
+    }
+    for (i = 0; i < MAXJOBS; i++)
+        if (jobs[i].pid != 0)
+            journal(J_ADD, &jobs[i]);
+    if (rename(tmp, path) < 0) {
+        unlink(tmp);
+        close(journal_fd);
+        journal_fd = fd;    /* carry on appending to the old one */
+    } else {
+        close(fd);
+    }
+
+    /* Orphaned descendants of our future jobs come back to us */
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+}
+
+/*
+ * journal - Append one record about job. Uses a single write(), so it
+ *     is safe to call from the SIGCHLD handler for J_DEL and J_STATE.
+ */
+void journal(int op, struct job_t *job) {
+    struct {
+        struct jrec_t rec;
+        char cmd[MAXLINE];
+    } buf;
+    int len = 0;
+
+    if (journal_fd < 0)
+        return;
+    memset(&buf.rec, 0, sizeof(buf.rec));
+    buf.rec.op = op;
+    buf.rec.pid = job->pid;
+    buf.rec.jid = job->jid;
+    buf.rec.state = job->state;
+    if (op == J_ADD) {
+        buf.rec.start = proc_start(job->pid, NULL);
+        len = strlen(jobcmd(job));
+        if (len > MAXLINE - 1)
+            len = MAXLINE - 1;
+        memcpy(buf.cmd, jobcmd(job), len);
+    }
+    buf.rec.len = len;
+    if (write(journal_fd, &buf, sizeof(buf.rec) + len) < 0)
+        return; /* nothing useful to do about it mid-job */
+}
+
+/*
+ * proc_start - Return pid's start time from /proc/<pid>/stat (0 if it
+ *     is gone) and, if state isn't NULL, its one-letter run state.
+ */
+unsigned long long proc_start(pid_t pid, char *state) {
+    char path[64], buf[512];
+    char *p;
+    int fd, n, field;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+
+    /* The command name may hold spaces; fields resume after its ')' */
+    if ((p = strrchr(buf, ')')) == NULL || p[1] == '\0')
+        return 0;
+    p = p + 2;
+    if (state)
+        *state = *p;
+    for (field = 3; field < 22 && p; field++)
+        if ((p = strchr(p, ' ')) != NULL)
+            p = p + 1;
+    return p ? strtoull(p, NULL, 10) : 0;
+}
+
+/* find_adopted - Index of pid in the adopted list, or -1 */
+int find_adopted(pid_t pid) {
+    int i;
+
+    for (i = 0; i < num_adopted; i++)
+        if (adopted[i].pid == pid)
+            return i;
+    return -1;
+}
+
+/*
+ * adopted_check - Bring adopted job i up to date from /proc: drop it
+ *     if it has exited, and track stops and continues, since no SIGCHLD
+ *     will tell us. SIGCHLD is blocked meanwhile, as the handler edits
+ *     the same job list and journal. Returns 0 if the job is gone.
+ */
+int adopted_check(int i) {
+    struct job_t *job;
+    sigset_t mask, prev;
+    char state = 0;
+    int alive = 1;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+
+    job = getjobpid(jobs, adopted[i].pid);
+    if (job == NULL || proc_start(adopted[i].pid, &state) != adopted[i].start ||
+        state == 'Z' || state == 'X') {
+        if (adopted[i].pidfd >= 0)
+            close(adopted[i].pidfd);
+        if (job)
+            deletejob(jobs, adopted[i].pid);
+        adopted[i] = adopted[--num_adopted];
+        alive = 0;
+    } else if (state == 'T' && job->state != ST) {
+        job->state = ST;
+        journal(J_STATE, job);
+        oprintf("Job [%d] (%d) was halted\n", job->jid, job->pid);
+    } else if (state != 'T' && job->state == ST) {
+        job->state = BG;
+        journal(J_STATE, job);
+    }
+
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return alive;
+}
+
+/* adopted_refresh - adopted_check every adopted job */
+void adopted_refresh(void) {
+    int i;
+
+    for (i = num_adopted - 1; i >= 0; i--)
+        adopted_check(i);
+}
+
+/*
+ * wait_adopted - waitfg for an adopted job: sleep on its pidfd (which
+ *     becomes readable when it exits) and look for stops in between.
+ */
+void wait_adopted(pid_t pid) {
+    struct pollfd pfd;
+    struct job_t *job;
+    int i;
+
+    while ((i = find_adopted(pid)) >= 0 && adopted_check(i) &&
+           (job = getjobpid(jobs, pid)) != NULL && job->state == FG) {
+        pfd.fd = adopted[i].pidfd;
+        pfd.events = POLLIN;
+        if (pfd.fd >= 0)
+            poll(&pfd, 1, 50);
+        else
+            usleep(50000);
+    }
+}
+
+/**************************************
+ * Alias and function definitions
+ **************************************/
+
+/* finddef - Find the alias or function called name, NULL if none */
+struct def_t *finddef(char *name) {
+    int i;
+
+    for (i = 0; i < MAXDEFS; i++)
+        if (defs[i].name && strcmp(defs[i].name, name) == 0)
+            return &defs[i];
+    return NULL;
+}
+
+/*
+ * adddef - Define (or redefine) an alias or function. The body is
+ *     tokenized and scanned for operators once, here, so that calls
+ *     never go through parseline or total_num_pipes again. Nothing is
+ *     expanded yet: $NAME in the body expands each time it runs.
+ */
+int adddef(char *name, char *body, int is_func) {
+    struct def_t *def = finddef(name);
+    char line[MAXLINE], words[MAXLINE + 1];
+    char *argv[MAXARGS];
+    char *store;
+    int i, argc, len;
+
+    if (!def) {
+        for (i = 0; i < MAXDEFS && defs[i].name; i++)
+            ;
+        if (i == MAXDEFS) {
+            oprintf("Tried to create too many definitions\n");
+            return 0;
+        }
+        def = &defs[i];
+    } else {
+        cleardef(def);
+    }
+
+    snprintf(line, MAXLINE, "%s\n", body);
+    argc = split_line(line, words, argv);
+    if (argc == 0) {
+        oprintf("%s: Empty definition\n", name);
+        return 0;
+    }
+
+    /* The name goes in the store too, as a literal token for $0 */
+    len = strlen(name) + strlen(body) + 2 * argc + 2;
+    def->store = store = malloc(len);
+    *store++ = '\'';
+    def->name = strcpy(store, name);
+    store = store + strlen(name) + 1;
+    save_tokens(argv, argc, def->cmd.argv, store, def->store + len);
+    def->text = strdup(body);
+    def->is_func = is_func;
+    def->cmd.argc = argc;
+    cmd_scan(&def->cmd, 0);
+    return 1;
+}
+
+/* cleardef - Free a definition slot */
+void cleardef(struct def_t *def) {
+    free(def->text);
+    free(def->store);
+    memset(def, 0, sizeof(*def));
+}
+
+/*
+ * positional - If tok is $N or ${N}, return N (0-9); $@ returns -2.
+ *     Anything else returns -1.
+ */
+int positional(char *tok) {
+    if (tok[0] != '$')
+        return -1;
+    if (tok[1] == '@' && tok[2] == '\0')
+        return -2;
+    if (isdigit(tok[1]) && tok[2] == '\0')
+        return tok[1] - '0';
+    if (tok[1] == '{' && isdigit(tok[2]) && tok[3] == '}' && tok[4] == '\0')
+        return tok[2] - '0';
+    return -1;
+}
+
+/*
+ * expand_def - Replace the call in cmd (name plus arguments) with the
+ *     definition's cached tokens. An alias appends the arguments; a
+ *     function substitutes them for $1..$9 and $@ token by token. The
+ *     cached operator scan is reused unless substitution moved tokens.
+ */
+void expand_def(struct def_t *def, struct cmd_t *cmd) {
+    char *args[MAXARGS];
+    int nargs = cmd->argc - 1;
+    int i, j, n, rescan = 0;
+
+    memcpy(args, cmd->argv + 1, nargs * sizeof(char *));
+
+    if (!def->is_func) {
+        memcpy(cmd, &def->cmd, sizeof(*cmd));
+        for (i = 0; i < nargs && cmd->argc < MAXARGS - 1; i++)
+            cmd->argv[cmd->argc++] = args[i];
+        cmd->argv[cmd->argc] = NULL;
+        cmd_scan(cmd, def->cmd.argc);
+        return;
+    }
+
+    cmd->argc = 0;
+    for (i = 0; i < def->cmd.argc && cmd->argc < MAXARGS - 1; i++) {
+        n = positional(def->cmd.argv[i]);
+        if (n == -1) {
+            cmd->argv[cmd->argc++] = def->cmd.argv[i];
+        } else if (n == -2) {
+            for (j = 0; j < nargs && cmd->argc < MAXARGS - 1; j++)
+                cmd->argv[cmd->argc++] = args[j];
+            rescan = 1;
+        } else if (n == 0) {
+            cmd->argv[cmd->argc++] = def->name;
+        } else if (n <= nargs) {
+            cmd->argv[cmd->argc++] = args[n - 1];
+            if (strchr("|<>", args[n - 1][0]))
+                rescan = 1;
+        } else {
+            rescan = 1;  /* unset parameter expands to nothing */
+        }
+    }
+    cmd->argv[cmd->argc] = NULL;
+
+    if (rescan) {
+        cmd_scan(cmd, 0);
+    } else {
+        cmd->pipes = def->cmd.pipes;
+        cmd->plain = def->cmd.plain;
+        memcpy(cmd->stage, def->cmd.stage, (cmd->pipes + 1) * sizeof(int));
+    }
+}
+
+/*
+ * join_args - Glue argv back into one space-separated string, dropping
+ *     one level of surrounding quotes and a trailing ';'.
+ */
+void join_args(char **argv, char *out) {
+    int len;
+
+    out[0] = '\0';
+    while (*argv) {
+        if (out[0])
+            strncat(out, " ", MAXLINE - strlen(out) - 1);
+        strncat(out, *argv, MAXLINE - strlen(out) - 1);
+        argv = argv + 1;
+    }
+
+    len = strlen(out);
+    if (len > 0 && out[len - 1] == ';')
+        out[--len] = '\0';
+    if (len >= 2 && (out[0] == '\'' || out[0] == '"') && out[len - 1] == out[0]) {
+        memmove(out, out + 1, len - 2);
+        out[len - 2] = '\0';
+    }
+}
+
+/* listdefs - Print every definition in a form that would recreate it */
+void listdefs(void) {
+    int i;
+
+    for (i = 0; i < MAXDEFS; i++) {
+        if (!defs[i].name)
+            continue;
+        if (defs[i].is_func)
+            oprintf("%s() { %s; }\n", defs[i].name, defs[i].text);
+        else
+            oprintf("alias %s='%s'\n", defs[i].name, defs[i].text);
+    }
+}
+
+/*
+ * builtin_alias - alias               list all definitions
+ *                 alias name=body...  define an alias
+ *                 alias name body...  same, for bodies given as one word
+ *                 alias name          show one definition
+ */
+int builtin_alias(char **argv) {
+    char name[MAXLINE];
+    char body[MAXLINE];
+    struct def_t *def;
+    char *eq;
+
+    if (!argv[1]) {
+        listdefs();
+        return 1;
+    }
+
+    strncpy(name, argv[1], MAXLINE - 1);
+    name[MAXLINE - 1] = '\0';
+    if ((eq = strchr(name, '=')) != NULL) {
+        *eq = '\0';
+        argv[1] = argv[1] + (eq - name) + 1;
+        join_args(argv[1][0] ? argv + 1 : argv + 2, body);
+    } else if (argv[2]) {
+        join_args(argv + 2, body);
+    } else {
+        if ((def = finddef(name)) != NULL && !def->is_func)
+            oprintf("alias %s='%s'\n", def->name, def->text);
+        else
+            oprintf("%s: Alias was not found\n", name);
+        return 1;
+    }
+
+    adddef(name, body, 0);
+    return 1;
+}
+
+/* builtin_unalias - Remove aliases or functions by name */
+int builtin_unalias(char **argv) {
+    struct def_t *def;
+
+    argv = argv + 1;
+    while (*argv) {
+        if ((def = finddef(*argv)) != NULL)
+            cleardef(def);
+        else
+            oprintf("%s: Alias was not found\n", *argv);
+        argv = argv + 1;
+    }
+    return 1;
+}
+
+/*
+ * builtin_function - function name { body }
+ *                    name() { body }
+ *     Define a function whose body is a single pipeline; $1..$9 and
+ *     $@ in it are replaced by the call's arguments.
+ */
+int builtin_function(char **argv) {
+    char name[MAXLINE];
+    char body[MAXLINE];
+    int argc, len;
+
+    if (strcmp(argv[0], "function") == 0)
+        argv = argv + 1;
+    if (!argv[0]) {
+        listdefs();
+        return 1;
+    }
+
+    strncpy(name, argv[0], MAXLINE - 1);
+    name[MAXLINE - 1] = '\0';
+    len = strlen(name);
+    if (len > 2 && strcmp(name + len - 2, "()") == 0)
+        name[len - 2] = '\0';
+
+    for (argc = 0; argv[argc]; argc++)
+        ;
+    if (argc < 3 || strcmp(argv[1], "{") != 0 || strcmp(argv[argc - 1], "}") != 0) {
+        oprintf("%s: Function body must be given as { command; }\n", name);
+        return 1;
+    }
+    argv[argc - 1] = NULL;
+    join_args(argv + 2, body);
+
+    adddef(name, body, 1);
+    return 1;
+}
+
+/**************************************
+ * Loop builtins
+ **************************************/
+
+/*
+ * save_tokens - Copy argv[0..argc-1] into store (up to end) for a loop
+ *     or definition to keep, pointing out[] at the copies. Each copy
+ *     keeps the byte before it, so a literal token stays marked (see
+ *     is_literal). The parser's buffers are reused by the next line (or
+ *     an alias defined in the loop) and definitions can go away, so a
+ *     loop can't point into them. Returns the next free byte of store,
+ *     or NULL if it is full.
+ */
+char *save_tokens(char **argv, int argc, char **out, char *store, char *end) {
+    int i, len;
+
+    for (i = 0; i < argc; i++) {
+        len = strlen(argv[i]) + 1;
+        if (store + 1 + len > end)
+            return NULL;
+        *store++ = argv[i][-1];
+        memcpy(store, argv[i], len);
+        move_heredoc(argv[i], store);
+        out[i] = store;
+        store = store + len;
+    }
+    out[argc] = NULL;
+    return store;
+}
+
+/*
+ * prepare_cmd - Turn argv[0..argc-1], tokens the loop owns, into a
+ *     cmd_t that can be run many times, scanned for operators once.
+ *     cmdline gets the text to record for the job.
+ */
+void prepare_cmd(char **argv, int argc, struct cmd_t *cmd, char *cmdline) {
+    memcpy(cmd->argv, argv, argc * sizeof(char *));
+    cmd->argv[argc] = NULL;
+    cmd->argc = argc;
+
+    join_args(cmd->argv, cmdline);
+    strcat(cmdline, "\n");
+    cmd_scan(cmd, 0);
+}
+
+/*
+ * run_cmd - Run a prepared command in the foreground. An alias or
+ *     function at its head is looked up on every run, as eval does, so
+ *     the loop body sees definitions made or removed as it goes.
+ */
+void run_cmd(struct cmd_t *cmd, char *cmdline) {
+    struct cmd_t run;
+    struct def_t *def;
+    char arena[MAXLINE];
+
+    memcpy(&run, cmd, sizeof(run));
+    if ((def = finddef(run.argv[0])) != NULL)
+        expand_def(def, &run);
+    expand_tokens(&run, arena, MAXLINE);
+    if (!builtin_cmd(run.argv))
+        start_cmd(&run, 0, cmdline);
+}
+
+/* elapsed_ms - Milliseconds between two CLOCK_MONOTONIC readings */
+double elapsed_ms(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e3 +
+           (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/*
+ * builtin_repeat - repeat [-t] N command args...
+ *     Run the command N times from its parsed form. With -t, print the
+ *     min/avg/max wall time of a run.
+ */
+int builtin_repeat(char **argv) {
+    struct cmd_t cmd;
+    char *tokens[MAXARGS];
+    char cmdline[MAXLINE], store[MAXLINE + MAXARGS], count[MAXLINE];
+    char *countp = count;
+    struct timespec start, end;
+    double ms, min = 0, max = 0, total = 0;
+    int timed = 0;
+    int i, n, argc;
+
+    argv = argv + 1;
+    if (*argv && strcmp(*argv, "-t") == 0) {
+        timed = 1;
+        argv = argv + 1;
+    }
+    if (*argv && !is_literal(*argv))
+        *argv = expand_word(*argv, &countp, count + MAXLINE);
+    if (!*argv || !isdigit(**argv) || !argv[1]) {
+        oprintf("Usage: repeat [-t] N command [args...]\n");
+        return 1;
+    }
+    n = atoi(*argv);
+    argv = argv + 1;
+
+    for (argc = 0; argv[argc]; argc++)
+        ;
+    if (!save_tokens(argv, argc, tokens, store, store + sizeof(store))) {
+        oprintf("repeat: Command too long\n");
+        return 1;
+    }
+    prepare_cmd(tokens, argc, &cmd, cmdline);
+
+    for (i = 0; i < n; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        run_cmd(&cmd, cmdline);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        ms = elapsed_ms(&start, &end);
+        if (i == 0 || ms < min)
+            min = ms;
+        if (ms > max)
+            max = ms;
+        total = total + ms;
+    }
+
+    if (timed && n > 0)
+        oprintf("repeat: %d runs, min %.3f ms, avg %.3f ms, max %.3f ms\n",
+               n, min, total / n, max);
+    return 1;
+}
+
+/*
+ * builtin_for - for NAME in WORD... ; do COMMAND [; COMMAND]... ; done
+ *     The loop copies its words, then splits the body into commands and
+ *     scans them once; each pass only sets NAME and expands the $
+ *     tokens of that cached form.
+ */
+int builtin_for(char **argv) {
+    struct cmd_t body[MAXBODY];
+    char cmdlines[MAXBODY][MAXLINE];
+    char *tokens[MAXARGS];
+    char *words[MAXARGS];
+    char store[MAXLINE + MAXARGS];
+    char wordbuf[MAXLINE], assignment[MAXLINE];
+    char *wordp = wordbuf;
+    char *name;
+    int nwords = 0, ncmds = 0;
+    int i, j, k, start, len, ends;
+
+    name = argv[1];
+    if (!name || !argv[2] || strcmp(argv[2], "in") != 0) {
+        oprintf("Usage: for NAME in WORD...; do COMMAND; done\n");
+        return 1;
+    }
+    if (var_name_len(name) != (int)strlen(name)) {
+        oprintf("%s: Not a valid variable name\n", name);
+        return 1;
+    }
+
+    /* From here on work on a copy: the ';' trimming below must not
+     * touch tokens an enclosing loop will run again */
+    for (i = 0; argv[i]; i++)
+        ;
+    if (!save_tokens(argv, i, tokens, store, store + sizeof(store))) {
+        oprintf("for: Command too long\n");
+        return 1;
+    }
+    argv = tokens;
+
+    /* The word list runs up to "do" */
+    for (i = 3; argv[i] && strcmp(argv[i], "do") != 0; i++) {
+        len = strlen(argv[i]);
+        if (len > 0 && argv[i][len - 1] == ';')
+            argv[i][--len] = '\0';
+        if (len > 0 && is_literal(argv[i]))
+            words[nwords++] = argv[i];
+        else if (len > 0)
+            words[nwords++] = expand_word(argv[i], &wordp, wordbuf + MAXLINE);
+    }
+    if (!argv[i]) {
+        oprintf("for: Missing do\n");
+        return 1;
+    }
+
+    /* The body runs up to "done", one command per ';' */
+    start = i + 1;
+    for (i = start; argv[i] && strcmp(argv[i], "done") != 0; i++) {
+        len = strlen(argv[i]);
+        ends = (len > 0 && argv[i][len - 1] == ';');
+        if (ends)
+            argv[i][--len] = '\0';
+        if (!ends && argv[i + 1] && strcmp(argv[i + 1], "done") != 0)
+            continue;
+
+        /* argv[start..i] is one command; a bare ";" is not part of it */
+        k = i + 1 - start - (len == 0);
+        if (k > 0) {
+            if (ncmds == MAXBODY) {
+                oprintf("for: Too many commands in body\n");
+                return 1;
+            }
+            prepare_cmd(argv + start, k, &body[ncmds], cmdlines[ncmds]);
+            ncmds = ncmds + 1;
+        }
+        start = i + 1;
+    }
+    if (!argv[i]) {
+        oprintf("for: Missing done\n");
+        return 1;
+    }
+
+    for (i = 0; i < nwords; i++) {
+        snprintf(assignment, MAXLINE, "%s=%s", name, words[i]);
+        setvar(assignment, 0);
+        for (j = 0; j < ncmds; j++)
+            run_cmd(&body[j], cmdlines[j]);
+    }
+    return 1;
+}
+
+/**************************************
+ * Shell variables and the environment
+ **************************************/
+
+/*
+ * load_vars - Import environ into the variable table, all exported.
+ *     Done on the first change, so a shell that never sets a variable
+ *     hands environ to its children untouched.
+ */
+void load_vars(void) {
+    char **env;
+
+    if (vars_loaded)
+        return;
+    vars_loaded = 1;
+    for (env = environ; *env; env++)
+        if (strchr(*env, '='))
+            putvar(strdup(*env), 1);
+    exec_envp = NULL;
+    envp_dirty = 1;
+}
+
+/* findvar - Find the variable whose name is name[0..len-1] */
+struct var_t *findvar(const char *name, int len) {
+    int i;
+
+    for (i = 0; i < num_vars; i++)
+        if (vars[i].name_len == len && strncmp(vars[i].entry, name, len) == 0)
+            return &vars[i];
+    return NULL;
+}
+
+/* getvar - Value of the variable name[0..len-1], NULL if unset */
+char *getvar(const char *name, int len) {
+    struct var_t *var;
+    char **env;
+
+    if (!vars_loaded) {
+        for (env = environ; *env; env++)
+            if (strncmp(*env, name, len) == 0 && (*env)[len] == '=')
+                return *env + len + 1;
+        return NULL;
+    }
+    var = findvar(name, len);
+    return var ? var->entry + len + 1 : NULL;
+}
+
+/*
+ * putvar - Store entry ("NAME=value", malloc'd) in the table, replacing
+ *     any old value. exported marks the variable for export; a variable
+ *     that already was exported stays that way.
+ */
+void putvar(char *entry, int exported) {
+    int len = strchr(entry, '=') - entry;
+    struct var_t *var = findvar(entry, len);
+
+    if (!var) {
+        if (num_vars == max_vars) {
+            max_vars = max_vars ? 2 * max_vars : 64;
+            vars = realloc(vars, max_vars * sizeof(struct var_t));
+        }
+        var = &vars[num_vars++];
+        var->entry = NULL;
+        var->name_len = len;
+        var->exported = 0;
+    }
+    free(var->entry);
+    var->entry = entry;
+    var->exported = var->exported || exported;
+    if (var->exported)
+        envp_dirty = 1;
+}
+
+/* setvar - Set NAME=value given as a single assignment word */
+void setvar(char *assignment, int exported) {
+    load_vars();
+    putvar(strdup(assignment), exported);
+}
+
+/* unsetvar - Remove a variable */
+void unsetvar(char *name) {
+    struct var_t *var;
+
+    load_vars();
+    if ((var = findvar(name, strlen(name))) == NULL)
+        return;
+    if (var->exported)
+        envp_dirty = 1;
+    free(var->entry);
+    *var = vars[--num_vars];
+}
+
+/*
+ * current_envp - The environment for execve. It is rebuilt only after
+ *     an exported variable has changed; otherwise the same array is
+ *     handed out every time, without copying. Call it in the shell,
+ *     before forking: a rebuild done in a child is lost with the child.
+ */
+char **current_envp(void) {
+    int i, n = 0;
+
+    if (!vars_loaded)
+        return environ;
+    if (envp_dirty) {
+        exec_envp = realloc(exec_envp, (num_vars + 1) * sizeof(char *));
+        for (i = 0; i < num_vars; i++)
+            if (vars[i].exported)
+                exec_envp[n++] = vars[i].entry;
+        exec_envp[n] = NULL;
+        envp_dirty = 0;
+    }
+    return exec_envp;
+}
+
+/*
+ * overlay_envp - base (from current_envp) plus a command's NAME=value
+ *     prefixes. Called in the child after fork, so the overlay is built
+ *     in the child's copy-on-write memory and the shell's own array is
+ *     never copied or touched.
+ */
+char **overlay_envp(char **base, char **assigns, int n) {
+    char **envp;
+    int i, j, count, len;
+
+    if (n == 0)
+        return base;
+    for (count = 0; base[count]; count++)
+        ;
+    envp = malloc((count + n + 1) * sizeof(char *));
+    memcpy(envp, base, count * sizeof(char *));
+
+    for (i = 0; i < n; i++) {
+        len = strchr(assigns[i], '=') - assigns[i] + 1;
+        for (j = 0; j < count; j++)
+            if (strncmp(envp[j], assigns[i], len) == 0)
+                break;
+        envp[j] = assigns[i];
+        if (j == count)
+            count = count + 1;
+    }
+    envp[count] = NULL;
+    return envp;
+}
+
+/* is_assignment - Is word of the form NAME=value? */
+int is_assignment(char *word) {
+    char *p = word;
+
+    if (!(isalpha(*p) || *p == '_'))
+        return 0;
+    while (isalnum(*p) || *p == '_')
+        p++;
+    return *p == '=';
+}
+
+/* var_name_len - Length of the variable name at the start of p */
+int var_name_len(const char *p) {
+    int len = 0;
+
+    if (!(isalpha(p[0]) || p[0] == '_'))
+        return 0;
+    while (isalnum(p[len]) || p[len] == '_')
+        len++;
+    return len;
+}
+
+/*
+ * is_literal - Is tok to be taken as it is, not $-expanded? Tokens are
+ *     stored with a spare byte before them, which holds '\'' for a
+ *     single-quoted token or one that is already the result of an
+ *     expansion.
+ */
+int is_literal(char *tok) {
+    return tok[-1] == '\'';
+}
+
+/*
+ * expand_word - Copy word into the arena with every $NAME and ${NAME}
+ *     replaced by its value (unset variables expand to nothing), marked
+ *     as literal so it is never expanded twice. The result is one word;
+ *     values are not split. Returns word itself if it holds no '$' or
+ *     the arena is full.
+ */
+char *expand_word(char *word, char **arena, char *end) {
+    char *out = *arena;
+    char *p, *value;
+    int len, braced;
+
+    if (!strchr(word, '$') || out >= end - 1)
+        return word;
+    *out++ = '\'';
+
+    for (p = word; *p && out < end - 1; ) {
+        braced = (p[0] == '$' && p[1] == '{');
+        len = (p[0] == '$') ? var_name_len(p + 1 + braced) : 0;
+        if (len == 0 || (braced && p[2 + len] != '}')) {
+            *out++ = *p++;
+            continue;
+        }
+        value = getvar(p + 1 + braced, len);
+        while (value && *value && out < end - 1)
+            *out++ = *value++;
+        p = p + 1 + braced + len + braced;
+    }
+    if (out >= end - 1)
+        return word;
+    *out++ = '\0';
+
+    value = *arena + 1;
+    *arena = out;
+    return value;
+}
+
+/*
+ * expand_tokens - Expand the $ tokens of a cached command at the time it
+ *     runs, using the caller's arena for the results. Literal tokens,
+ *     such as a call's arguments that parseline already expanded, are
+ *     left alone, and so is a command that stores its body for later.
+ */
+void expand_tokens(struct cmd_t *cmd, char *arena, int size) {
+    char *end = arena + size;
+    int i;
+
+    if (cmd->argc == 0 || defers_expansion(cmd->argv[0]))
+        return;
+    for (i = 0; i < cmd->argc; i++)
+        if (!is_literal(cmd->argv[i]))
+            cmd->argv[i] = expand_word(cmd->argv[i], &arena, end);
+}
+
+/* builtin_export - export [NAME[=value]...]; no arguments lists them */
+int builtin_export(char **argv) {
+    struct var_t *var;
+    char **env;
+
+    if (!argv[1]) {
+        for (env = current_envp(); *env; env++)
+            oprintf("export %s\n", *env);
+        return 1;
+    }
+
+    for (argv = argv + 1; *argv; argv++) {
+        if (is_assignment(*argv)) {
+            setvar(*argv, 1);
+        } else if (var_name_len(*argv) == (int)strlen(*argv)) {
+            load_vars();
+            if ((var = findvar(*argv, strlen(*argv))) != NULL) {
+                var->exported = 1;
+                envp_dirty = 1;
+            }
+        } else {
+            oprintf("%s: Not a valid variable name\n", *argv);
+        }
+    }
+    return 1;
+}
+
+/* builtin_unset - unset NAME... */
+int builtin_unset(char **argv) {
+    for (argv = argv + 1; *argv; argv++)
+        unsetvar(*argv);
+    return 1;
+}
+
+/**************************************
+ * Command result cache
+ **************************************/
+
+/*
+ * cache_dir - The cache directory ($TSH_CACHE_DIR, else ~/.cache/tsh),
+ *     created on first use. Returns NULL if there is nowhere to cache.
+ */
+char *cache_dir(void) {
+    static char dir[MAXLINE];
+    char *env = getenv("TSH_CACHE_DIR");
+    char *home = getenv("HOME");
+
+    if (dir[0])
+        return dir;
+    if (env)
+        snprintf(dir, MAXLINE, "%s", env);
+    else if (home) {
+        snprintf(dir, MAXLINE, "%s/.cache", home);
+        mkdir(dir, 0700);
+        strncat(dir, "/tsh", MAXLINE - strlen(dir) - 1);
+    } else
+        return NULL;
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        dir[0] = '\0';
+        return NULL;
+    }
+    return dir;
+}
+
+/*
+ * cache_key - Describe everything the first stage's output may depend
+ *     on: the working directory, its words (less any "> target"), PATH
+ *     and the named variables, and the identity and mtime of every
+ *     input file, both the declared ones and a "< file". Returns the
+ *     key's length, or -1 if the stage reads input that can't be named
+ *     (a here-document or process substitution) or the key won't fit.
+ */
+int cache_key(char **argv, int argc, char **inputs, int ninputs,
+              char **names, int nnames, char *key) {
+    struct stat st;
+    char cwd[MAXLINE];
+    char *value;
+    int len = 0;
+    int i;
+
+    if (!getcwd(cwd, MAXLINE))
+        cwd[0] = '\0';
+    len += snprintf(key + len, MAXKEY - len, "cwd %s\n", cwd);
+    value = getvar("PATH", 4);
+    len += snprintf(key + len, MAXKEY - len, "env PATH=%s\n", value ? value : "");
+    for (i = 0; i < nnames && len < MAXKEY; i++) {
+        value = getvar(names[i], strlen(names[i]));
+        len += snprintf(key + len, MAXKEY - len, "env %s=%s\n", names[i], value ? value : "");
+    }
+
+    for (i = 0; i < argc && len < MAXKEY; i++) {
+        if (strncmp(argv[i], "<<", 2) == 0 || is_procsub(argv[i]))
+            return -1;
+        if (strcmp(argv[i], ">") == 0) {
+            i = i + 1;
+            continue;
+        }
+        if (strcmp(argv[i], "<") == 0 && i + 1 < argc && is_procsub(argv[i + 1]))
+            return -1;
+        len += snprintf(key + len, MAXKEY - len, "arg %s\n", argv[i]);
+        if (i > 0 && strcmp(argv[i - 1], "<") == 0 && ninputs < MAXARGS)
+            inputs[ninputs++] = argv[i];
+    }
+
+    for (i = 0; i < ninputs && len < MAXKEY; i++) {
+        if (stat(inputs[i], &st) < 0)
+            len += snprintf(key + len, MAXKEY - len, "file %s missing\n", inputs[i]);
+        else
+            len += snprintf(key + len, MAXKEY - len, "file %s %lu %lu %lld %ld.%09ld\n",
+                            inputs[i], (unsigned long)st.st_dev, (unsigned long)st.st_ino,
+                            (long long)st.st_size, (long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    }
+    return len < MAXKEY ? len : -1;
+}
+
+/*
+ * cache_open - Open the cache entry at path for replay, if it holds the
+ *     output for this exact key. Returns an fd positioned at the start
+ *     of the output, or -1.
+ */
+int cache_open(char *path, char *key, int len) {
+    struct cache_hdr_t hdr;
+    char stored[MAXKEY];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, "tshc", 4) != 0 || hdr.keylen != len ||
+        read(fd, stored, len) != len || memcmp(stored, key, len) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* cache_age - qsort comparison putting the least recently used first */
+int cache_age(const void *a, const void *b) {
+    const struct cache_ent_t *x = a, *y = b;
+
+    if (x->used != y->used)
+        return x->used < y->used ? -1 : 1;
+    return 0;
+}
+
+/*
+ * cache_evict - Delete the least recently used entries until the cache
+ *     is no bigger than $TSH_CACHE_MAX bytes (default 64 MB). Hits bump
+ *     an entry's mtime, so mtime order is use order.
+ */
+void cache_evict(char *dir) {
+    struct cache_ent_t *ents = NULL;
+    struct dirent *de;
+    struct stat st;
+    char path[MAXLINE];
+    char *max_env = getenv("TSH_CACHE_MAX");
+    long long max = max_env ? atoll(max_env) : 64LL << 20;
+    long long total = 0;
+    int n = 0, size = 0, i;
+    DIR *d = opendir(dir);
+
+    if (!d)
+        return;
+    while ((de = readdir(d)) != NULL) {
+        if (strlen(de->d_name) != 16)
+            continue; /* not an entry, or one still being written */
+        snprintf(path, MAXLINE, "%s/%s", dir, de->d_name);
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (n == size) {
+            size = size ? 2 * size : 64;
+            ents = realloc(ents, size * sizeof(*ents));
+        }
+        memcpy(ents[n].name, de->d_name, 17);
+        ents[n].used = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        ents[n].size = st.st_size;
+        total = total + st.st_size;
+        n = n + 1;
+    }
+    closedir(d);
+
+    if (total > max) {
+        qsort(ents, n, sizeof(*ents), cache_age);
+        for (i = 0; i < n && total > max; i++) {
+            snprintf(path, MAXLINE, "%s/%s", dir, ents[i].name);
+            if (unlink(path) == 0)
+                total = total - ents[i].size;
+        }
+    }
+    free(ents);
+}
+
+/*
+ * cache_replay - Send cached output where the first stage's output
+ *     would have gone: to its "> target" or stdout, with no process
+ *     involved, or as the stdin of the rest of the pipeline.
+ */
+void cache_replay(int fd, struct cmd_t *cmd, int end, char *cmdline) {
+    struct cmd_t rest;
+    char buf[8192];
+    int out = STDOUT_FILENO;
+    int n, i, saved;
+
+    if (cmd->pipes == 0) {
+        for (i = 0; i + 1 < end; i++) {
+            if (strcmp(cmd->argv[i], ">") != 0)
+                continue;
+            if (out != STDOUT_FILENO)
+                close(out);
+            out = open(cmd->argv[i + 1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            if (out < 0) {
+                perror("given fopen error");
+                return;
+            }
+        }
+        oflush();
+        while ((n = read(fd, buf, sizeof(buf))) > 0)
+            if (write(out, buf, n) != n)
+                break;
+        if (out != STDOUT_FILENO)
+            close(out);
+        return;
+    }
+
+    rest.argc = cmd->argc - cmd->stage[1];
+    memcpy(rest.argv, cmd->argv + cmd->stage[1], (rest.argc + 1) * sizeof(char *));
+    cmd_scan(&rest, 0);
+
+    saved = dup(STDIN_FILENO);
+    dup2(fd, STDIN_FILENO);
+    launch_cmd(&rest, 0, cmdline);
+    dup2(saved, STDIN_FILENO);
+    close(saved);
+}
+
+/*
+ * run_cached - cached [-i file]... [-e NAME]... cmd args [| ...]
+ *
+ * Memoize the output of the pipeline's first stage. The result is
+ * keyed by cache_key and stored in the cache directory under the key's
+ * hash. A hit is replayed without forking; a miss runs the stage into
+ * a private file, which becomes the cache entry only if the command
+ * exits with status 0, and is then replayed the same way. Background
+ * jobs, and stages whose input can't be named, just run uncached.
+ */
+void run_cached(struct cmd_t *prepared, int command_bg, char *cmdline) {
+    struct cmd_t copy = *prepared; /* repeat and for reuse *prepared */
+    struct cmd_t *cmd = &copy;
+    struct cache_hdr_t hdr;
+    struct cmd_t part;
+    char *inputs[MAXARGS], *names[MAXARGS];
+    char key[MAXKEY], path[MAXLINE], tmp[MAXLINE + 16];
+    unsigned long long hash = 14695981039346656037ULL;
+    int nin = 0, nenv = 0, skip = 1;
+    int end, len, fd, saved, i;
+    char *dir;
+    pid_t pid;
+
+    while (skip < cmd->argc &&
+           (strcmp(cmd->argv[skip], "-i") == 0 || strcmp(cmd->argv[skip], "-e") == 0)) {
+        if (skip + 1 == cmd->argc) {
+            oprintf("Usage: cached [-i file]... [-e NAME]... command [args...]\n");
+            return;
+        }
+        if (cmd->argv[skip][1] == 'i')
+            inputs[nin++] = cmd->argv[skip + 1];
+        else
+            names[nenv++] = cmd->argv[skip + 1];
+        skip = skip + 2;
+    }
+    cmd->argc = cmd->argc - skip;
+    memmove(cmd->argv, cmd->argv + skip, (cmd->argc + 1) * sizeof(char *));
+    if (cmd->argc == 0) {
+        oprintf("cached: Missing command\n");
+        return;
+    }
+    cmd_scan(cmd, 0);
+    end = cmd->pipes ? cmd->stage[1] - 1 : cmd->argc;
+
+    if (command_bg || (dir = cache_dir()) == NULL ||
+        (len = cache_key(cmd->argv, end, inputs, nin, names, nenv, key)) < 0) {
+        launch_cmd(cmd, command_bg, cmdline);
+        return;
+    }
+    for (i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+    snprintf(path, MAXLINE, "%s/%016llx", dir, hash);
+
+    if ((fd = cache_open(path, key, len)) >= 0) {
+        utimensat(AT_FDCWD, path, NULL, 0); /* mark it recently used */
+        cache_replay(fd, cmd, end, cmdline);
+        close(fd);
+        return;
+    }
+
+    /* Miss: run the first stage alone, with its output going to tmp */
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    memcpy(hdr.magic, "tshc", 4);
+    hdr.keylen = len;
+    if (fd < 0 || write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || write(fd, key, len) != len) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        launch_cmd(cmd, 0, cmdline);
+        return;
+    }
+
+    part.argc = 0;
+    for (i = 0; i < end; i++) {
+        if (strcmp(cmd->argv[i], ">") == 0)
+            i = i + 1;
+        else
+            part.argv[part.argc++] = cmd->argv[i];
+    }
+    part.argv[part.argc] = NULL;
+    cmd_scan(&part, 0);
+
+    oflush();
+    saved = dup(STDOUT_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    pid = launch_cmd(&part, 0, cmdline);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    if (getjobpid(jobs, pid) != NULL) {
+        /* Stopped before finishing: there is nothing whole to keep */
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    if (exit_pid == pid && WIFEXITED(exit_status) && WEXITSTATUS(exit_status) == 0 &&
+        rename(tmp, path) == 0)
+        cache_evict(dir);
+    else
+        unlink(tmp);
+
+    lseek(fd, sizeof(hdr) + len, SEEK_SET);
+    cache_replay(fd, cmd, end, cmdline);
+    close(fd);
+}
+
+/**************************************
+ * Persistent history
+ **************************************/
+
+/*
+ * history_open - Open (creating if needed) the history log, its index
+ *     and its search filters. Nothing is read here: lookups map the files on demand.
+ *     Returns 0 if history can't be kept.
+ */
+int history_open(void) {
+    char path[MAXLINE];
+    char *file = getenv("TSH_HISTFILE");
+    char *home = getenv("HOME");
+
+    if (hist_log >= 0)
+        return 1;
+    if (!hist_enabled)
+        return 0;
+
+    if (file)
+        snprintf(path, MAXLINE, "%s", file);
+    else if (home)
+        snprintf(path, MAXLINE, "%s/.tsh_history", home);
+    else
+        return hist_enabled = 0;
+
+    hist_log = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    strncat(path, ".idx", MAXLINE - strlen(path) - 1);
+    hist_idx = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    strcpy(path + strlen(path) - 4, ".tri");
+    hist_tri = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (hist_log < 0 || hist_idx < 0) {
+        if (hist_log >= 0)
+            close(hist_log);
+        if (hist_idx >= 0)
+            close(hist_idx);
+        if (hist_tri >= 0)
+            close(hist_tri);
+        hist_log = hist_idx = hist_tri = -1;
+        return hist_enabled = 0;
+    }
+    atexit(history_close);
+    return 1;
+}
+
+/*
+ * history_add - Queue a command line for the history file and try to
+ *     write it out. If another tsh holds the file lock the line just
+ *     stays queued; the read/eval loop never waits for the lock.
+ */
+void history_add(char *cmdline) {
+    int len = strcspn(cmdline, "\n");
+
+    if (len == 0 || !history_open())
+        return;
+    if (num_pending == max_pending) {
+        max_pending = max_pending ? 2 * max_pending : 16;
+        hist_pending = realloc(hist_pending, max_pending * sizeof(char *));
+    }
+    hist_pending[num_pending++] = strndup(cmdline, len);
+    history_flush(0);
+}
+
+/*
+ * history_flush - Append queued lines to the log and index under an
+ *     exclusive lock on the index. The log line and its filter bits are
+ *     written first, so any index record another tsh can see points at
+ *     complete text that the filters already know about. Returns 1 if
+ *     the queue was emptied.
+ */
+int history_flush(int wait) {
+    struct hist_rec_t rec;
+    struct stat st;
+    unsigned long long indexed = 0;
+    char line[MAXLINE + 1];
+    size_t count;
+    int i, len;
+
+    if (num_pending == 0)
+        return 1;
+    if (flock(hist_idx, wait ? LOCK_EX : LOCK_EX | LOCK_NB) < 0)
+        return 0;
+
+    /* catch the filters up with entries they missed (older files) */
+    fstat(hist_idx, &st);
+    count = st.st_size / sizeof(struct hist_rec_t);
+    if (hist_tri >= 0 && pread(hist_tri, &indexed, sizeof(indexed), 0) != sizeof(indexed))
+        indexed = 0;
+    if (indexed > count)
+        indexed = 0;
+    if (indexed < count)
+        history_reindex(indexed, count);
+
+    fstat(hist_log, &st);
+    for (i = 0; i < num_pending; i++) {
+        len = strlen(hist_pending[i]);
+        if (len > MAXLINE - 1)
+            len = MAXLINE - 1;
+        memcpy(line, hist_pending[i], len);
+        line[len] = '\n';
+
+        memset(&rec, 0, sizeof(rec));
+        rec.off = st.st_size;
+        rec.len = len;
+        memcpy(rec.prefix, line, len < 4 ? len : 4);
+        if (write(hist_log, line, len + 1) != len + 1)
+            break;
+        history_index(count + i, line, len);
+        if (write(hist_idx, &rec, sizeof(rec)) != sizeof(rec))
+            break;
+        st.st_size = st.st_size + len + 1;
+        free(hist_pending[i]);
+    }
+
+    flock(hist_idx, LOCK_UN);
+    memmove(hist_pending, hist_pending + i, (num_pending - i) * sizeof(char *));
+    num_pending = num_pending - i;
+    return num_pending == 0;
+}
+
+/* trigram - Hash the 3 bytes at s to a bit of a search filter */
+unsigned trigram(char *s) {
+    unsigned char *u = (unsigned char *)s;
+
+    return ((u[0] << 16 | u[1] << 8 | u[2]) * 2654435761u) % (HISTBLOOM * 8);
+}
+
+/*
+ * history_index - Set the filter bits for entry n (0-based) and count
+ *     it as indexed. A block's filter holds every trigram of its
+ *     HISTBLOCK entries, so a search can skip any block missing one of
+ *     the key's trigrams. Called with the history lock held.
+ */
+void history_index(size_t n, char *line, int len) {
+    unsigned char bloom[HISTBLOOM];
+    unsigned long long indexed = n + 1;
+    off_t off = (n / HISTBLOCK + 1) * (off_t)HISTBLOOM;
+    unsigned h;
+    int i;
+
+    if (hist_tri < 0)
+        return;
+    memset(bloom, 0, HISTBLOOM);
+    if (pread(hist_tri, bloom, HISTBLOOM, off) < 0)
+        return;
+    for (i = 0; i + 3 <= len; i++) {
+        h = trigram(line + i);
+        bloom[h / 8] |= 1 << (h % 8);
+    }
+    if (pwrite(hist_tri, bloom, HISTBLOOM, off) == HISTBLOOM)
+        pwrite(hist_tri, &indexed, sizeof(indexed), 0);
+}
+
+/*
+ * history_reindex - Rebuild the filters for entries from..count-1,
+ *     which are already on disk: a history written before the filters
+ *     existed, or by a tsh that couldn't open them. Called with the
+ *     history lock held.
+ */
+void history_reindex(size_t from, size_t count) {
+    unsigned char bloom[HISTBLOOM];
+    unsigned long long indexed;
+    size_t n, block;
+    unsigned h;
+    char *text;
+    int i;
+
+    if (hist_tri < 0 || history_map() < count)
+        return;
+    for (n = from; n < count; ) {
+        block = n / HISTBLOCK;
+        memset(bloom, 0, HISTBLOOM);
+        if (n % HISTBLOCK != 0 &&
+            pread(hist_tri, bloom, HISTBLOOM, (block + 1) * (off_t)HISTBLOOM) < 0)
+            return;
+        for (; n < count && n / HISTBLOCK == block; n++) {
+            text = hist_text + hist_recs[n].off;
+            for (i = 0; i + 3 <= (int)hist_recs[n].len; i++) {
+                h = trigram(text + i);
+                bloom[h / 8] |= 1 << (h % 8);
+            }
+        }
+        if (pwrite(hist_tri, bloom, HISTBLOOM, (block + 1) * (off_t)HISTBLOOM) != HISTBLOOM)
+            return;
+    }
+    indexed = count;
+    pwrite(hist_tri, &indexed, sizeof(indexed), 0);
+}
+
+/* history_close - Write out anything still queued, waiting if need be */
+void history_close(void) {
+    if (hist_log >= 0)
+        history_flush(1);
+}
+
+/*
+ * history_map - Make sure the mapping of the index and log covers every
+ *     record written so far (by any tsh), remapping only when the index
+ *     has grown. The filters are mapped for however many of those
+ *     records they cover. Returns the number of records on disk.
+ */
+int history_map(void) {
+    unsigned long long indexed = 0;
+    struct stat st;
+    size_t count, log_len, bloom_len;
+
+    if (!history_open())
+        return 0;
+    fstat(hist_idx, &st);
+    count = st.st_size / sizeof(struct hist_rec_t);
+    if (count == hist_count)
+        return hist_count;
+
+    if (hist_recs)
+        munmap(hist_recs, hist_count * sizeof(struct hist_rec_t));
+    if (hist_text)
+        munmap(hist_text, hist_text_len);
+    if (hist_bloom)
+        munmap(hist_bloom, hist_bloom_len);
+    hist_recs = NULL;
+    hist_text = NULL;
+    hist_bloom = NULL;
+    hist_count = 0;
+    hist_indexed = 0;
+    if (count == 0)
+        return 0;
+
+    hist_recs = mmap(NULL, count * sizeof(struct hist_rec_t), PROT_READ, MAP_SHARED, hist_idx, 0);
+    if (hist_recs == MAP_FAILED) {
+        hist_recs = NULL;
+        return 0;
+    }
+    log_len = hist_recs[count - 1].off + hist_recs[count - 1].len + 1;
+    hist_text = mmap(NULL, log_len, PROT_READ, MAP_SHARED, hist_log, 0);
+    if (hist_text == MAP_FAILED) {
+        munmap(hist_recs, count * sizeof(struct hist_rec_t));
+        hist_recs = NULL;
+        hist_text = NULL;
+        return 0;
+    }
+    hist_text_len = log_len;
+    hist_count = count;
+
+    /* the filters are written before the index, so fstat them after it */
+    if (hist_tri < 0 || pread(hist_tri, &indexed, sizeof(indexed), 0) != sizeof(indexed))
+        return hist_count;
+    if (indexed > count)
+        indexed = count;
+    bloom_len = ((indexed + HISTBLOCK - 1) / HISTBLOCK + 1) * HISTBLOOM;
+    fstat(hist_tri, &st);
+    if (indexed == 0 || (size_t)st.st_size < bloom_len)
+        return hist_count;
+    hist_bloom = mmap(NULL, bloom_len, PROT_READ, MAP_SHARED, hist_tri, 0);
+    if (hist_bloom == MAP_FAILED) {
+        hist_bloom = NULL;
+        return hist_count;
+    }
+    hist_bloom_len = bloom_len;
+    hist_indexed = indexed;
+    return hist_count;
+}
+
+/*
+ * history_get - Fetch entry n (1-based, counting queued lines after
+ *     the ones on disk). Returns its length, or -1 if there is none.
+ */
+int history_get(int n, char **text) {
+    int count = history_map();
+
+    if (n < 1 || n > count + num_pending)
+        return -1;
+    if (n > count) {
+        *text = hist_pending[n - count - 1];
+        return strlen(*text);
+    }
+    *text = hist_text + hist_recs[n - 1].off;
+    return hist_recs[n - 1].len;
+}
+
+/*
+ * history_find - Search backwards for the newest entry that starts with
+ *     (or, if substring, contains) key. On disk, a block of entries is
+ *     skipped whole if its filter lacks one of the key's trigrams, and
+ *     prefix searches compare the 4-byte prefix kept in each index
+ *     record, so most entries are rejected without touching the log.
+ *     Returns the entry number, or 0.
+ */
+int history_find(char *key, int substring) {
+    int keylen = strlen(key);
+    int cmp = keylen < 4 ? keylen : 4;
+    int count = history_map();
+    unsigned tri[MAXLINE];
+    unsigned char *bloom;
+    int n, i, len, ntri;
+    char *text;
+
+    for (ntri = 0; ntri + 3 <= keylen && ntri < MAXLINE; ntri++)
+        tri[ntri] = trigram(key + ntri);
+
+    for (n = count + num_pending; n > 0; n--) {
+        if (ntri > 0 && n <= (int)hist_indexed) {
+            bloom = hist_bloom + ((n - 1) / HISTBLOCK + 1) * HISTBLOOM;
+            for (i = 0; i < ntri; i++)
+                if (!(bloom[tri[i] / 8] & 1 << (tri[i] % 8)))
+                    break;
+            if (i < ntri) {
+                n = (n - 1) / HISTBLOCK * HISTBLOCK + 1;
+                continue;
+            }
+        }
+        if (n <= count && !substring && memcmp(hist_recs[n - 1].prefix, key, cmp) != 0)
+            continue;
+        len = history_get(n, &text);
+        if (substring ? memmem(text, len, key, keylen) != NULL
+                      : (len >= keylen && memcmp(text, key, keylen) == 0))
+            return n;
+    }
+    return 0;
+}
+
+/*
+ * history_expand - If cmdline starts with a history reference, replace
+ *     it with the entry and echo the result:
+ *         !!  last entry       !n  entry n       !-n  n entries back
+ *         !prefix  newest entry starting with prefix
+ *         !?text   newest entry containing text
+ *     Returns 1 if the line was expanded, 0 if it had no reference and
+ *     -1 (after printing an error) if the reference matched nothing.
+ */
+int history_expand(char *cmdline) {
+    char expanded[MAXLINE];
+    char word[MAXLINE];
+    char *start = cmdline + strspn(cmdline, " ");
+    char *rest, *text;
+    int n, len, count;
+
+    if (start[0] != '!' || start[1] == '\0' || isspace(start[1]))
+        return 0;
+
+    rest = start + strcspn(start, " \n");
+    len = rest - start;
+    memcpy(word, start, len);
+    word[len] = '\0';
+
+    count = history_map() + num_pending;
+    if (strcmp(word, "!!") == 0)
+        n = count;
+    else if (word[1] == '-' && isdigit(word[2]))
+        n = count - atoi(word + 2) + 1;
+    else if (isdigit(word[1]))
+        n = atoi(word + 1);
+    else if (word[1] == '?') {
+        word[strcspn(word + 2, "?") + 2] = '\0';
+        n = history_find(word + 2, 1);
+    } else
+        n = history_find(word + 1, 0);
+
+    if ((len = history_get(n, &text)) < 0) {
+        oprintf("%s: event not found\n", word);
+        return -1;
+    }
+
+    if (len > MAXLINE - 2)
+        len = MAXLINE - 2;
+    memcpy(expanded, text, len);
+    snprintf(expanded + len, MAXLINE - len, "%s", rest);
+    if (expanded[strlen(expanded) - 1] != '\n')
+        strcat(expanded, "\n");
+    strcpy(cmdline, expanded);
+    oprintf("%s", cmdline);
+    return 1;
+}
+
+/* builtin_history - history [n]: list the last n entries (default 16) */
+int builtin_history(char **argv) {
+    int count, n, last;
+    char *text;
+    int len;
+
+    if (!hist_enabled) {
+        oprintf("history: History is not being kept\n");
+        return 1;
+    }
+    last = argv[1] ? atoi(argv[1]) : 16;
+    count = history_map() + num_pending;
+    for (n = count - last + 1 > 1 ? count - last + 1 : 1; n <= count; n++) {
+        len = history_get(n, &text);
+        oprintf("%5d  %.*s\n", n, len, text);
+    }
+    return 1;
+}
+
+/*********************************************
+ * Input reader and control socket routines
+ *********************************************/
+
+/*
+ * readline_buf - Move one complete line (including its '\n') out of
+ *     lb into line. Returns 1 if a line was available, 0 otherwise.
+ *     A line that fills the whole buffer is returned as-is.
+ */
+int readline_buf(struct linebuf_t *lb, char *line) {
+    char *nl = memchr(lb->buf, '\n', lb->len);
+    int n;
+
+    if (nl)
+        n = nl - lb->buf + 1;
+    else if (lb->len == MAXLINE - 1)
+        n = lb->len;
+    else
+        return 0;
+
+    memcpy(line, lb->buf, n);
+    line[n] = '\0';
+    lb->len = lb->len - n;
+    memmove(lb->buf, lb->buf + n, lb->len);
+    return 1;
+}
+
+/* fill_buf - Read more input into lb; returns read(2)'s result */
+int fill_buf(struct linebuf_t *lb) {
+    int n;
+
+    oflush(); /* read() may block */
+    do {
+        n = read(lb->fd, lb->buf + lb->len, MAXLINE - 1 - lb->len);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0)
+        lb->len = lb->len + n;
+    return n;
+}
+
+/*
+ * next_cmdline - Wait for the next command line on stdin. While
+ *     waiting, any lines arriving on the control socket are evaluated
+ *     in place. Returns 0 once stdin is at EOF and there is no control
+ *     socket left to serve.
+ */
+int next_cmdline(char *cmdline) {
+    struct pollfd fds[MAXCLIENTS + MAXJOBS + 2];
+    struct linebuf_t *owner[MAXCLIENTS + MAXJOBS + 2];
+    int i, nfds, nlines, n;
+
+    while (1) {
+        if (input.fd >= 0 && readline_buf(&input, cmdline))
+            return 1;
+
+        if (ctl_fd < 0 && (num_adopted == 0 || input.fd < 0)) {
+            if (input.fd < 0 || fill_buf(&input) <= 0)
+                return 0;
+            continue;
+        }
+
+        nfds = 0;
+        if (input.fd >= 0) {
+            fds[nfds].fd = input.fd;
+            fds[nfds].events = POLLIN;
+            owner[nfds++] = &input;
+        }
+        if (ctl_fd >= 0) {
+            fds[nfds].fd = ctl_fd;
+            fds[nfds].events = POLLIN;
+            owner[nfds++] = NULL;
+        }
+        for (i = 0; i < MAXCLIENTS; i++) {
+            if (ctl_clients[i].fd >= 0) {
+                fds[nfds].fd = ctl_clients[i].fd;
+                fds[nfds].events = POLLIN;
+                owner[nfds++] = &ctl_clients[i];
+            }
+        }
+
+        /* Adopted jobs' pidfds wake us when they exit */
+        nlines = nfds;
+        for (i = 0; i < num_adopted; i++) {
+            fds[nfds].fd = adopted[i].pidfd;
+            fds[nfds].events = POLLIN;
+            owner[nfds++] = NULL;
+        }
+
+        oflush();
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("poll error");
+        }
+
+        for (i = nlines; i < nfds; i++)
+            if (fds[i].revents)
+                break;
+        if (i < nfds)
+            adopted_refresh();
+
+        for (i = 0; i < nlines; i++) {
+            if (!fds[i].revents)
+                continue;
+            if (owner[i] == NULL) {
+                ctl_accept();
+            } else if (owner[i] == &input) {
+                n = fill_buf(&input);
+                if (n <= 0 && !readline_buf(&input, cmdline))
+                    input.fd = -1;  /* keep serving the socket */
+            } else {
+                ctl_service(owner[i]);
+            }
+        }
+    }
+}
+
+/*
+ * ctl_open - Listen for control clients on the Unix-domain socket at
+ *     path. Each line a client sends is evaluated as a command line,
+ *     with the shell's output for it written back to that client.
+ */
+void ctl_open(char *path) {
+    struct sockaddr_un addr;
+    int i;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        app_error("control socket path too long");
+
+    for (i = 0; i < MAXCLIENTS; i++)
+        ctl_clients[i].fd = -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* Only a socket left behind by a shell that is gone is replaced */
+    if ((ctl_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        unix_error("control socket error");
+    if (bind(ctl_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+        (errno != EADDRINUSE || !ctl_stale(&addr) ||
+         bind(ctl_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0))
+        unix_error("control socket bind error");
+    if (listen(ctl_fd, MAXCLIENTS) < 0)
+        unix_error("control socket listen error");
+
+    /* A client hanging up must not take the shell down with it */
+    Signal(SIGPIPE, SIG_IGN);
+    atexit(ctl_close);
+}
+
+/*
+ * ctl_stale - Is the path in addr a socket nobody listens on any more?
+ *     If so, remove it and return 1. Anything else (a regular file, or
+ *     another shell's live socket) is left alone, with errno set to
+ *     EADDRINUSE.
+ */
+int ctl_stale(struct sockaddr_un *addr) {
+    struct stat st;
+    int fd, stale;
+
+    if (lstat(addr->sun_path, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+        errno = EADDRINUSE;
+        return 0;
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return 0;
+    stale = connect(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0 &&
+            errno == ECONNREFUSED;
+    close(fd);
+    if (!stale) {
+        errno = EADDRINUSE;
+        return 0;
+    }
+    unlink(addr->sun_path);
+    return 1;
+}
+
+/* ctl_accept - Take a pending connection on the control socket */
+void ctl_accept(void) {
+    int i, fd;
+
+    if ((fd = accept4(ctl_fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+        return;
+    for (i = 0; i < MAXCLIENTS; i++) {
+        if (ctl_clients[i].fd < 0) {
+            ctl_clients[i].fd = fd;
+            ctl_clients[i].len = 0;
+            return;
+        }
+    }
+    close(fd);  /* too many clients */
+}
+
+/* ctl_service - Read from a control client and run each full line */
+void ctl_service(struct linebuf_t *client) {
+    char cmdline[MAXLINE];
+
+    sigset_t mask, prev;
+    int i;
+
+    if (fill_buf(client) <= 0) {
+        /* Its jobs report to the shell from now on, not to a stale fd */
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, &prev);
+        for (i = 0; i < MAXJOBS; i++)
+            if (jobs[i].pid != 0 && jobs[i].owner == client->fd)
+                jobs[i].owner = -1;
+        close(client->fd);
+        client->fd = -1;
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        return;
+    }
+    while (client->fd >= 0 && readline_buf(client, cmdline)) {
+        cur_input = client;
+        ctl_eval(client->fd, cmdline);
+        cur_input = &input;
+    }
+}
+
+/*
+ * ctl_eval - Evaluate a command line on behalf of a control client.
+ *     stdout is pointed at the client for the duration, so both the
+ *     shell's replies and the output of any job it starts go there.
+ *     Jobs started here remember the client, so their later state
+ *     changes are reported to it too (see notify).
+ */
+void ctl_eval(int fd, char *cmdline) {
+    sigset_t mask, prev;
+    int saved;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+
+    if ((saved = dup(STDOUT_FILENO)) < 0)
+        unix_error("dup error");
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    oflush(); /* with SIGCHLD blocked, no notice can slip in after it */
+    dup2(fd, STDOUT_FILENO);
+    out_owner = fd;
+    shell_stdout = saved;
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+
+    eval(cmdline);
+
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    oflush();
+    dup2(saved, STDOUT_FILENO);
+    out_owner = -1;
+    shell_stdout = STDOUT_FILENO;
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    close(saved);
+}
+
+/* ctl_close - Remove the control socket when the shell exits */
+void ctl_close(void) {
+    if (ctl_fd >= 0) {
+        close(ctl_fd);
+        unlink(ctl_path);
+        ctl_fd = -1;
+    }
+}
+
+/*********************************************
+ * Output buffer
+ *
+ * All of the shell's own output is collected here and written with one
+ * writev() when the shell is about to block (waiting for a foreground
+ * job or for input), fork, or exit. The SIGCHLD handler can't safely
+ * touch outbuf, so it queues its messages in sigbuf, which oprintf
+ * drains first to keep everything in the order it was produced.
+ *********************************************/
+
+/*
+ * oprintf - printf into the output buffer, flushing it first if the
+ *     text won't fit. Text bigger than the whole buffer goes straight out.
+ */
+void oprintf(const char *fmt, ...) {
+    va_list ap;
+    char *big;
+    int n;
+
+    if (sig_len)
+        take_sigbuf();
+
+    va_start(ap, fmt);
+    n = vsnprintf(outbuf + out_len, OUTBUF - out_len, fmt, ap);
+    va_end(ap);
+    if (n < OUTBUF - out_len) {
+        out_len = out_len + n;
+        return;
+    }
+
+    oflush();
+    va_start(ap, fmt);
+    if (n < OUTBUF)
+        out_len = vsnprintf(outbuf, OUTBUF, fmt, ap);
+    else if ((n = vasprintf(&big, fmt, ap)) >= 0) {
+        struct iovec iov = {big, n};
+        write_all(&iov, 1);
+        free(big);
+    }
+    va_end(ap);
+}
+
+/*
+ * sig_printf - oprintf for signal handlers. If sigbuf is full it is
+ *     written out on the spot, since the handler can't wait for a flush.
+ */
+void sig_printf(const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(sigbuf + sig_len, OUTBUF - sig_len, fmt, ap);
+    va_end(ap);
+    if (n < OUTBUF - sig_len) {
+        sig_len = sig_len + n;
+        return;
+    }
+
+    struct iovec iov = {sigbuf, sig_len};
+    write_all(&iov, 1);
+    va_start(ap, fmt);
+    n = vsnprintf(sigbuf, OUTBUF, fmt, ap);
+    va_end(ap);
+    sig_len = n < OUTBUF ? n : OUTBUF - 1;
+}
+
+/*
+ * notify - Report a change in job's state to whoever started it: the
+ *     shell's own stdout, or the control client that ran the command.
+ *     If that is where stdout points right now the message is queued
+ *     in order with everything else; if not, it goes out in one write().
+ */
+void notify(struct job_t *job, const char *fmt, ...) {
+    char buf[MAXLINE];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, MAXLINE, fmt, ap);
+    va_end(ap);
+    if (n >= MAXLINE)
+        n = MAXLINE - 1;
+
+    if (job->owner == out_owner)
+        sig_printf("%s", buf);
+    else if (write(job->owner >= 0 ? job->owner : shell_stdout, buf, n) < 0)
+        return; /* e.g. the client has gone */
+}
+
+/* take_sigbuf - Move the handler's queued messages onto outbuf */
+void take_sigbuf(void) {
+    sigset_t mask, prev;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    if (sig_len > OUTBUF - out_len)
+        oflush();
+    memcpy(outbuf + out_len, sigbuf, sig_len);
+    out_len = out_len + sig_len;
+    sig_len = 0;
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * oflush - Write out both buffers with a single writev(). SIGCHLD is
+ *     only blocked when the handler has queued something, so the usual
+ *     flush costs exactly one system call.
+ */
+void oflush(void) {
+    struct iovec iov[2];
+    sigset_t mask, prev;
+
+    if (sig_len == 0) {
+        if (out_len == 0)
+            return;
+        iov[0].iov_base = outbuf;
+        iov[0].iov_len = out_len;
+        write_all(iov, 1);
+        out_len = 0;
+        return;
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    iov[0].iov_base = outbuf;
+    iov[0].iov_len = out_len;
+    iov[1].iov_base = sigbuf;
+    iov[1].iov_len = sig_len;
+    write_all(iov, 2);
+    out_len = 0;
+    sig_len = 0;
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* write_all - writev() to stdout until everything is out or it fails */
+void write_all(struct iovec *iov, int cnt) {
+    ssize_t n;
+
+    while (cnt > 0) {
+        if ((n = writev(STDOUT_FILENO, iov, cnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return; /* e.g. a control client went away */
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n = n - iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len = iov->iov_len - n;
+        }
+    }
+}
+
+/***********************
+ * Other helper routines
+ ***********************/
+
+/*
+ * usage - print a help message and terminate
+ */
+void usage(void) {
+    oprintf("Usage: shell [-hvpT] [-s socket] [-J journal]\n");
+    oprintf("   -h   print this message\n");
+    oprintf("   -v   print additional diagnostic information\n");
+    oprintf("   -p   do not emit a command prompt\n");
+    oprintf("   -T   print how long each startup phase took\n");
+    oprintf("   -s   also accept commands on the Unix socket <socket>\n");
+    oprintf("   -J   keep a job journal in <journal>, adopting jobs left in it\n");
+    exit(1);
+}
+
+/*
+ * startup_report - Print how long each startup phase took. The time
+ *     from exec to main (mostly the dynamic loader) is the CPU time the
+ *     process had used on entering main; the later phases are wall time,
+ *     up to the first prompt having been written.
+ */
+void startup_report(struct timespec *cpu, struct timespec *phases) {
+    struct timespec zero = {0, 0};
+
+    oprintf("startup: exec to main %.3f ms, signals %.3f ms, "
+            "init %.3f ms, first prompt %.3f ms\n",
+            elapsed_ms(&zero, cpu), elapsed_ms(&phases[0], &phases[1]),
+            elapsed_ms(&phases[1], &phases[2]), elapsed_ms(&phases[2], &phases[3]));
 }
 
 /*
  * unix_error - unix-style error routine
  */
 void unix_error(char *msg) {
-    fprintf(stdout, "%s: %s\n", msg, strerror(errno));
+    oprintf("%s: %s\n", msg, strerror(errno));
     exit(1);
 }
 
@@ -794,7 +3784,7 @@ void unix_error(char *msg) {
  * app_error - application-style error routine
  */
 void app_error(char *msg) {
-    fprintf(stdout, "%s\n", msg);
+    oprintf("%s\n", msg);
     exit(1);
 }
 
@@ -818,6 +3808,6 @@ handler_t *Signal(int signum, handler_t *handler) {
  *    child shell by sending it a SIGQUIT signal.
  */
 void sigquit_handler(int sig) {
-    printf("Terminating after receipt of SIGQUIT signal\n");
+    sig_printf("Terminating after receipt of SIGQUIT signal\n");
     exit(1);
 }
\ No newline at end of file